@@ -0,0 +1,91 @@
+/**
+ * Burst allocation benchmark
+ *
+ * Allocates and frees bursts of 2K packet buffers from a 64 MiB arena, once
+ * with loops of buddy_arena_alloc()/buddy_arena_free() and once with
+ * buddy_arena_alloc_bulk()/buddy_arena_free_bulk(). Blocks are freed in a
+ * shuffled order, as they come back from a pipeline.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (64 << 20)
+#define BUFFER_SIZE 2048
+#define MAX_BURST 256
+#define BLOCKS_PER_RUN 4000000
+
+static void *burst[MAX_BURST];
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void shuffle(void **a, int n, unsigned int *seed)
+{
+	for (int i = n - 1; i > 0; i--) {
+		int j = rand_r(seed) % (i + 1);
+		void *t = a[i];
+		a[i] = a[j];
+		a[j] = t;
+	}
+}
+
+/**
+ * @return nanoseconds per block for an alloc+free round trip
+ */
+static double run(buddy_t *arena, int n, int bulk)
+{
+	unsigned int seed = 1;
+	int rounds = BLOCKS_PER_RUN / n;
+	double elapsed = 0;
+
+	for (int r = 0; r < rounds; r++) {
+		double start = now_ns();
+		if (bulk) {
+			int got = buddy_arena_alloc_bulk(arena, BUFFER_SIZE, n, burst);
+			assert(got == n);
+			(void)got;
+		} else {
+			for (int i = 0; i < n; i++)
+				burst[i] = buddy_arena_alloc(arena, BUFFER_SIZE);
+		}
+		elapsed += now_ns() - start;
+
+		shuffle(burst, n, &seed);
+
+		start = now_ns();
+		if (bulk) {
+			buddy_arena_free_bulk(arena, burst, n);
+		} else {
+			for (int i = 0; i < n; i++)
+				buddy_arena_free(arena, burst[i]);
+		}
+		elapsed += now_ns() - start;
+	}
+	return elapsed / ((double)rounds * n);
+}
+
+int main()
+{
+	void *mem = malloc(ARENA_SIZE);
+	buddy_t *arena = buddy_create(mem, ARENA_SIZE, 11);
+	assert(arena != NULL);
+
+	printf("burst,singles_ns_per_block,bulk_ns_per_block\n");
+	for (int n = 32; n <= MAX_BURST; n *= 2) {
+		double singles = run(arena, n, 0);
+		double bulk = run(arena, n, 1);
+		printf("%d,%.1f,%.1f\n", n, singles, bulk);
+	}
+
+	buddy_destroy(arena);
+	free(mem);
+	return EXIT_SUCCESS;
+}
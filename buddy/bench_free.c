@@ -0,0 +1,73 @@
+/**
+ * Free path microbenchmark
+ *
+ * Fragments the heap so that free_area[MIN_ORDER] holds a given number of
+ * blocks, then repeatedly frees a 4K block whose buddy is still allocated and
+ * allocates it back. The free cost should not depend on the free list length.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS ((1<<20) / BLOCK_SIZE)
+#define ITERATIONS 200000
+
+static void *blocks[NUM_BLOCKS];
+
+static int cmp_addr(const void *a, const void *b)
+{
+	char *x = *(char **)a;
+	char *y = *(char **)b;
+	return (x > y) - (x < y);
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Time free+alloc pairs with free_len blocks sitting on the 4K free list
+ *
+ * @param free_len number of free 4K blocks, at most NUM_BLOCKS / 2 - 1
+ * @return nanoseconds per free+alloc pair
+ */
+static double run(int free_len)
+{
+	buddy_init();
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+		blocks[i] = buddy_alloc(BLOCK_SIZE);
+		assert(blocks[i] != NULL);
+	}
+	qsort(blocks, NUM_BLOCKS, sizeof(blocks[0]), cmp_addr);
+
+	/* free every other block so nothing can coalesce */
+	for (int i = 0; i < free_len; i++)
+		buddy_free(blocks[2 * i]);
+
+	/* this block's buddy is allocated, so it stays on the 4K list */
+	void *victim = blocks[2 * free_len + 1];
+
+	double start = now_ns();
+	for (int i = 0; i < ITERATIONS; i++) {
+		buddy_free(victim);
+		/* any 4K block that comes back still has an allocated buddy */
+		victim = buddy_alloc(BLOCK_SIZE);
+	}
+	return (now_ns() - start) / ITERATIONS;
+}
+
+int main()
+{
+	printf("free_list_len,ns_per_free_alloc\n");
+	for (int len = 1; len < NUM_BLOCKS / 2; len *= 2)
+		printf("%d,%.1f\n", len, run(len));
+	printf("%d,%.1f\n", NUM_BLOCKS / 2 - 1, run(NUM_BLOCKS / 2 - 1));
+	return EXIT_SUCCESS;
+}
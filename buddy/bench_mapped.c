@@ -0,0 +1,67 @@
+/**
+ * Mapped arena benchmark
+ *
+ * Creates a 1 GiB arena on its own mapping and reports the resident memory of
+ * the process after creating it, after touching 64 MiB of 1 MiB blocks and
+ * after freeing them again, once keeping the memory and once releasing free
+ * 2 MiB blocks back to the OS.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (1UL << 30)
+#define MIN_ORDER 12
+#define BLOCK_SIZE (1 << 20)
+#define NUM_BLOCKS 64
+
+static void *blocks[NUM_BLOCKS];
+
+/* resident set size in KiB */
+static long rss_kb()
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void run(const char *name, int release_order)
+{
+	long base = rss_kb();
+	buddy_t *arena = buddy_create_mapped(ARENA_SIZE, MIN_ORDER, release_order, 0);
+
+	assert(arena != NULL);
+	long created = rss_kb() - base;
+
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+		blocks[i] = buddy_arena_alloc(arena, BLOCK_SIZE);
+		assert(blocks[i] != NULL);
+		memset(blocks[i], 1, BLOCK_SIZE);
+	}
+	long touched = rss_kb() - base;
+
+	for (int i = 0; i < NUM_BLOCKS; i++)
+		buddy_arena_free(arena, blocks[i]);
+	long freed = rss_kb() - base;
+
+	printf("%s,%ld,%ld,%ld\n", name, created, touched, freed);
+	buddy_destroy(arena);
+}
+
+int main()
+{
+	printf("arena,created_kb,touched_kb,freed_kb\n");
+	run("keep", -1);
+	run("release", 21);
+	return EXIT_SUCCESS;
+}
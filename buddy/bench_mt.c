@@ -0,0 +1,94 @@
+/**
+ * Multi-threaded alloc/free throughput benchmark
+ *
+ * Every thread keeps a private window of live blocks in one shared 64 MiB
+ * arena and randomly frees or allocates slots in it. Mostly small blocks that
+ * the per-CPU magazines serve, with some larger ones that go to the core.
+ *
+ * Usage: ./bench_mt [max_threads]
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (64 << 20)
+#define LIVE_SLOTS 64
+#define OPS_PER_THREAD 1000000
+
+static buddy_t *arena;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+	void *live[LIVE_SLOTS] = { NULL };
+
+	for (int i = 0; i < OPS_PER_THREAD; i++) {
+		int slot = rand_r(&seed) % LIVE_SLOTS;
+
+		if (live[slot] != NULL) {
+			buddy_arena_free(arena, live[slot]);
+			live[slot] = NULL;
+		} else {
+			int r = rand_r(&seed) % 100;
+			/* 90% 1K-32K, 10% 64K-256K */
+			int size = r < 90 ? 1024 << (r % 6) : 65536 << (r % 3);
+			live[slot] = buddy_arena_alloc(arena, size);
+		}
+	}
+	for (int slot = 0; slot < LIVE_SLOTS; slot++) {
+		if (live[slot] != NULL)
+			buddy_arena_free(arena, live[slot]);
+	}
+	return NULL;
+}
+
+/**
+ * Run the workload on a number of threads
+ * @return alloc+free operations per second over all threads
+ */
+static double run(int nthreads)
+{
+	pthread_t threads[nthreads];
+
+	double start = now_ns();
+	for (long i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_ns() - start;
+
+	return (double)nthreads * OPS_PER_THREAD / (elapsed / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	void *mem = malloc(ARENA_SIZE);
+
+	arena = buddy_create(mem, ARENA_SIZE, 12);
+	assert(arena != NULL);
+
+	printf("threads,ops_per_sec,scaling\n");
+	double base = 0;
+	for (int n = 1; n <= max_threads; n *= 2) {
+		double ops = run(n);
+		if (n == 1)
+			base = ops;
+		printf("%d,%.0f,%.2f\n", n, ops, ops / base);
+	}
+
+	buddy_destroy(arena);
+	free(mem);
+	return EXIT_SUCCESS;
+}
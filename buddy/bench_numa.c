@@ -0,0 +1,162 @@
+/**
+ * NUMA front end benchmark
+ *
+ * First checks the routing: a thread pinned to a node allocates there until
+ * the node is exhausted and then falls back to the nearest one, and frees
+ * find their node by address or turn the address away. Then every thread, pinned to node thread % nodes,
+ * keeps a window of live blocks that it writes and reads, once with
+ * node-local allocation and once interleaved over all nodes. Nodes the
+ * machine does not have are simulated.
+ *
+ * Usage: ./bench_numa [max_threads] [nodes]
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numa.h"
+
+#define NODE_SIZE (64 << 20)
+#define MIN_ORDER 12
+#define LIVE_SLOTS 64
+#define OPS_PER_THREAD 200000
+
+static buddy_numa_t *numa;
+static int nr_nodes;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* allocations stay local until the node runs out, then spill to the
+ * nearest; which one that is is only known when every other node is
+ * simulated */
+static void check_routing()
+{
+	static void *blocks[NODE_SIZE / (1 << 20) + 1];
+	int n = NODE_SIZE / (1 << 20);
+	int simulated = access("/sys/devices/system/node/node1", F_OK) != 0;
+	int freed = 0;
+	buddy_numa_stats_t st;
+
+	numa = buddy_numa_create(nr_nodes, NODE_SIZE, MIN_ORDER, 0);
+	assert(numa != NULL);
+	buddy_numa_set_node(0);
+	assert(buddy_numa_node(numa) == 0);
+
+	for (int i = 0; i < n; i++) {
+		blocks[i] = buddy_numa_alloc(numa, 1 << 20);
+		assert(buddy_numa_node_of(numa, blocks[i]) == 0);
+	}
+	blocks[n] = buddy_numa_alloc(numa, 1 << 20);
+	if (nr_nodes == 1)
+		assert(blocks[n] == NULL);
+	else
+		assert(buddy_numa_node_of(numa, blocks[n]) > 0);
+	if (simulated && nr_nodes > 1)
+		assert(buddy_numa_node_of(numa, blocks[n]) == 1);
+
+	buddy_numa_stats(numa, 0, &st);
+	assert(st.local_allocs == (unsigned long)n && st.remote_allocs == 0);
+	assert(st.arena.bytes_allocated == (size_t)NODE_SIZE);
+	if (nr_nodes > 1) {
+		buddy_numa_stats(numa, buddy_numa_node_of(numa, blocks[n]), &st);
+		assert(st.local_allocs == 0 && st.remote_allocs == 1);
+	}
+
+	for (int i = 0; i <= n; i++)
+		freed += buddy_numa_free(numa, blocks[i]) == 0;
+	assert(freed == n + 1);
+
+	/* a block freed twice and an address of no arena are turned away */
+	freed = buddy_numa_free(numa, blocks[0]) + buddy_numa_free(numa, &st);
+	assert(freed == -2);
+
+	/* the last node spills to its neighbour, not round to node 0 */
+	if (simulated && nr_nodes > 2) {
+		buddy_numa_set_node(nr_nodes - 1);
+		for (int i = 0; i <= n; i++)
+			blocks[i] = buddy_numa_alloc(numa, 1 << 20);
+		assert(buddy_numa_node_of(numa, blocks[n]) == nr_nodes - 2);
+		for (int i = 0; i <= n; i++)
+			buddy_numa_free(numa, blocks[i]);
+	}
+
+	int bound = 0;
+	for (int node = 0; node < nr_nodes; node++) {
+		buddy_numa_stats(numa, node, &st);
+		assert(st.arena.bytes_allocated == 0);
+		bound += st.bound;
+	}
+	buddy_numa_set_node(-1);
+	buddy_numa_destroy(numa);
+	printf("routing ok on %d nodes, %d bound\n", nr_nodes, bound);
+}
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+	void *live[LIVE_SLOTS] = { NULL };
+	int size[LIVE_SLOTS];
+	unsigned long sum = 0;
+
+	buddy_numa_set_node((long)arg % nr_nodes);
+	for (int i = 0; i < OPS_PER_THREAD; i++) {
+		int slot = rand_r(&seed) % LIVE_SLOTS;
+
+		if (live[slot] != NULL) {
+			for (int j = 0; j < size[slot]; j += 64)
+				sum += ((char *)live[slot])[j];
+			buddy_numa_free(numa, live[slot]);
+			live[slot] = NULL;
+		} else {
+			size[slot] = 4096 << (rand_r(&seed) % 4);
+			live[slot] = buddy_numa_alloc(numa, size[slot]);
+			memset(live[slot], slot, size[slot]);
+		}
+	}
+	for (int slot = 0; slot < LIVE_SLOTS; slot++)
+		buddy_numa_free(numa, live[slot]);
+	return (void *)sum;
+}
+
+/**
+ * Run the workload on a number of threads
+ * @return alloc+free operations per second over all threads
+ */
+static double run(int nthreads, int flags)
+{
+	pthread_t threads[nthreads];
+
+	numa = buddy_numa_create(nr_nodes, NODE_SIZE, MIN_ORDER, flags);
+	assert(numa != NULL);
+
+	double start = now_ns();
+	for (long i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_ns() - start;
+
+	buddy_numa_destroy(numa);
+	return (double)nthreads * OPS_PER_THREAD / (elapsed / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	nr_nodes = argc > 2 ? atoi(argv[2]) : 2;
+
+	check_routing();
+	printf("threads,local_ops_per_sec,interleaved_ops_per_sec\n");
+	for (int t = 1; t <= max_threads; t *= 2)
+		printf("%d,%.0f,%.0f\n", t, run(t, 0), run(t, BUDDY_NUMA_INTERLEAVE));
+	return EXIT_SUCCESS;
+}
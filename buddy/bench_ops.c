@@ -0,0 +1,69 @@
+/**
+ * Alloc/free cost and metadata footprint on a large fine grained arena
+ *
+ * Creates a 64 MiB arena with 64 byte pages, reports how much heap the arena
+ * metadata takes and then times a random alloc/free mix of 64B-64K blocks
+ * over a window of live blocks.
+ */
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (64 << 20)
+#define MIN_ORDER 6
+#define LIVE_SLOTS 4096
+#define OPERATIONS 4000000
+
+static void *live[LIVE_SLOTS];
+
+/* heap bytes in use, including chunks malloc serves with mmap */
+static size_t heap_in_use()
+{
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main()
+{
+	void *mem = malloc(ARENA_SIZE);
+	size_t before = heap_in_use();
+	buddy_t *arena = buddy_create(mem, ARENA_SIZE, MIN_ORDER);
+	size_t metadata = heap_in_use() - before;
+	unsigned int seed = 1;
+
+	assert(arena != NULL);
+
+	double start = now_ns();
+	unsigned long long cycles = __rdtsc();
+	for (int i = 0; i < OPERATIONS; i++) {
+		int slot = rand_r(&seed) % LIVE_SLOTS;
+
+		if (live[slot] != NULL) {
+			buddy_arena_free(arena, live[slot]);
+			live[slot] = NULL;
+		} else {
+			live[slot] = buddy_arena_alloc(arena, 64 << (rand_r(&seed) % 11));
+		}
+	}
+	cycles = __rdtsc() - cycles;
+	double elapsed = now_ns() - start;
+
+	printf("metadata_bytes,ns_per_op,cycles_per_op\n");
+	printf("%zu,%.1f,%.1f\n", metadata, elapsed / OPERATIONS, (double)cycles / OPERATIONS);
+
+	buddy_destroy(arena);
+	free(mem);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+/**
+ * Arena reset benchmark
+ *
+ * Fills a 4 GiB arena with 4 KiB blocks a number of times and throws all of
+ * them away at once, by freeing them one by one, by destroying and creating
+ * the arena again, and with buddy_arena_reset(). Reports the time each takes
+ * per round.
+ *
+ * Usage: ./bench_reset [blocks per round]
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (4UL << 30)
+#define MIN_ORDER 12
+#define ROUNDS 20
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_blocks = argc > 1 ? atoi(argv[1]) : 100000;
+	void **blocks = malloc(nr_blocks * sizeof(*blocks));
+	double t_free = 0, t_create = 0, t_reset = 0;
+
+	assert(blocks != NULL);
+	buddy_t *arena = buddy_create_mapped(ARENA_SIZE, MIN_ORDER, -1, 0);
+	assert(arena != NULL);
+
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < nr_blocks; i++)
+			assert((blocks[i] = buddy_arena_alloc(arena, 1 << MIN_ORDER)) != NULL);
+		double t0 = now();
+		for (int i = 0; i < nr_blocks; i++)
+			buddy_arena_free(arena, blocks[i]);
+		t_free += now() - t0;
+
+		for (int i = 0; i < nr_blocks; i++)
+			assert((blocks[i] = buddy_arena_alloc(arena, 1 << MIN_ORDER)) != NULL);
+		t0 = now();
+		buddy_destroy(arena);
+		arena = buddy_create_mapped(ARENA_SIZE, MIN_ORDER, -1, 0);
+		t_create += now() - t0;
+		assert(arena != NULL);
+
+		for (int i = 0; i < nr_blocks; i++)
+			assert((blocks[i] = buddy_arena_alloc(arena, 1 << MIN_ORDER)) != NULL);
+		t0 = now();
+		buddy_arena_reset(arena);
+		t_reset += now() - t0;
+	}
+	if (buddy_arena_check(arena) != (long)ARENA_SIZE) {
+		fprintf(stderr, "arena not empty after reset\n");
+		return EXIT_FAILURE;
+	}
+	buddy_destroy(arena);
+	free(blocks);
+
+	printf("blocks,free_all_us,recreate_us,reset_us\n");
+	printf("%d,%.1f,%.1f,%.1f\n", nr_blocks, t_free / ROUNDS * 1e6, t_create / ROUNDS * 1e6,
+	       t_reset / ROUNDS * 1e6);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/**
+ * Shared arena benchmark
+ *
+ * A producer process fills messages and hands them to a consumer process
+ * over a pipe, once by copying every payload through the pipe and once by
+ * allocating it in a shared arena and passing only its offset. The consumer
+ * checks each message and frees it into the shared arena. Afterwards the
+ * arena must be consistent and empty.
+ *
+ * Usage: ./bench_shared [messages] [message bytes]
+ */
+#include <assert.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (256UL << 20)
+#define MIN_ORDER 12
+
+static size_t msg_size = 64 << 10;
+static long nr_msgs = 20000;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void read_all(int fd, void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+
+		assert(n > 0);
+		buf = (char *)buf + n;
+		len -= n;
+	}
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+
+		assert(n > 0);
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+}
+
+/* stamp a message with its number at both ends */
+static void fill(uint64_t *msg, uint64_t seq)
+{
+	msg[0] = seq;
+	msg[msg_size / sizeof(uint64_t) - 1] = seq;
+}
+
+static void check(const uint64_t *msg, uint64_t seq)
+{
+	if (msg[0] != seq || msg[msg_size / sizeof(uint64_t) - 1] != seq) {
+		fprintf(stderr, "message %lu corrupted\n", (unsigned long)seq);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void consume_copy(int fd)
+{
+	uint64_t *msg = malloc(msg_size);
+
+	assert(msg != NULL);
+	for (long i = 0; i < nr_msgs; i++) {
+		read_all(fd, msg, msg_size);
+		check(msg, i);
+	}
+	free(msg);
+}
+
+static void consume_shared(int fd, const char *name)
+{
+	buddy_t *arena = buddy_open_shared(name);
+
+	assert(arena != NULL);
+	for (long i = 0; i < nr_msgs; i++) {
+		size_t offset;
+
+		read_all(fd, &offset, sizeof(offset));
+		check(buddy_address(arena, offset), i);
+		if (buddy_arena_free(arena, buddy_address(arena, offset)) != 0) {
+			fprintf(stderr, "message %ld: invalid free\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	buddy_destroy(arena);
+}
+
+static void run(const char *transport, buddy_t *arena, const char *name)
+{
+	int fds[2];
+
+	assert(pipe(fds) == 0);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		close(fds[1]);
+		if (arena != NULL)
+			consume_shared(fds[0], name);
+		else
+			consume_copy(fds[0]);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[0]);
+
+	uint64_t *buf = malloc(msg_size);
+	double start = now();
+
+	assert(buf != NULL);
+	for (long i = 0; i < nr_msgs; i++) {
+		if (arena == NULL) {
+			fill(buf, i);
+			write_all(fds[1], buf, msg_size);
+			continue;
+		}
+
+		/* wait for the consumer to free some room */
+		void *msg;
+		while ((msg = buddy_arena_alloc(arena, msg_size)) == NULL)
+			sched_yield();
+		fill(msg, i);
+		size_t offset = buddy_offset(arena, msg);
+		write_all(fds[1], &offset, sizeof(offset));
+	}
+	close(fds[1]);
+
+	int status;
+	waitpid(pid, &status, 0);
+	double elapsed = now() - start;
+	free(buf);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "%s: consumer failed\n", transport);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%s,%ld,%zu,%.1f,%.1f\n", transport, nr_msgs, msg_size,
+	       elapsed * 1e9 / nr_msgs, nr_msgs * (double)msg_size / elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	char name[64];
+
+	if (argc > 1)
+		nr_msgs = atol(argv[1]);
+	if (argc > 2)
+		msg_size = strtoul(argv[2], NULL, 0) & ~(sizeof(uint64_t) - 1);
+	if (nr_msgs < 1 || msg_size < sizeof(uint64_t) || msg_size > ARENA_SIZE / 4) {
+		fprintf(stderr, "Usage: %s [messages] [message bytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	snprintf(name, sizeof(name), "/bench_shared.%d", (int)getpid());
+	buddy_t *arena = buddy_create_shared(name, ARENA_SIZE, MIN_ORDER);
+	if (arena == NULL) {
+		perror("buddy_create_shared");
+		return EXIT_FAILURE;
+	}
+
+	printf("transport,msgs,msg_bytes,ns_per_msg,mb_per_s\n");
+	run("pipe copy", NULL, name);
+	run("shared arena", arena, name);
+
+	buddy_stats_t st;
+	buddy_arena_stats(arena, &st);
+	long free_bytes = buddy_arena_check(arena);
+	buddy_destroy(arena);
+	shm_unlink(name);
+
+	if (free_bytes != (long)ARENA_SIZE || st.invalid_frees != 0) {
+		fprintf(stderr, "shared arena: %ld of %lu bytes free after the run\n",
+			free_bytes, ARENA_SIZE);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
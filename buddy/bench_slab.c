@@ -0,0 +1,154 @@
+/**
+ * Small object benchmark
+ *
+ * First checks that objects of every size class come back intact and that
+ * frees of foreign, interior and freed addresses are turned away. Then keeps
+ * a window of live 32-512 byte objects in a 64 MiB arena with 4K pages
+ * and randomly frees and reallocates them, once straight from the buddy
+ * allocator and once through the slab layer. Reports the arena memory behind
+ * the live objects, how much of it is lost to rounding, the time per
+ * operation and how many buddy operations the run needed.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "slab.h"
+
+#define ARENA_SIZE (64 << 20)
+#define MIN_ORDER 12
+#define LIVE_SLOTS 8192
+#define OPERATIONS 4000000
+
+static void *live[LIVE_SLOTS];
+static int sizes[LIVE_SLOTS];
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long buddy_ops(buddy_t *arena)
+{
+	buddy_stats_t st;
+	unsigned long ops = 0;
+
+	buddy_arena_stats(arena, &st);
+	for (int o = 0; o < BUDDY_NR_ORDERS; o++)
+		ops += st.allocs[o] + st.frees[o];
+	return ops;
+}
+
+/* objects keep their contents, and only allocated objects can be freed */
+static void check_slab()
+{
+	void *mem = malloc(ARENA_SIZE);
+	buddy_t *arena = buddy_create(mem, ARENA_SIZE, MIN_ORDER);
+	slab_allocator_t *slab = slab_create(arena);
+	static unsigned char *objs[SLAB_MAX_OBJECT];
+	int rejected = 0;
+	int freed = 0;
+
+	assert(arena != NULL && slab != NULL);
+	for (int size = 1; size <= SLAB_MAX_OBJECT; size++) {
+		objs[size - 1] = slab_alloc(slab, size);
+		assert(objs[size - 1] != NULL && (uintptr_t)objs[size - 1] % 16 == 0);
+		memset(objs[size - 1], size, size);
+	}
+	for (int size = 1; size <= SLAB_MAX_OBJECT; size++)
+		for (int i = 0; i < size; i++)
+			assert(objs[size - 1][i] == (unsigned char)size);
+
+	/* not from the allocator, inside an object, a buddy block */
+	void *block = buddy_arena_alloc(arena, 1 << MIN_ORDER);
+	rejected += slab_free(slab, &rejected) == -1;
+	rejected += slab_free(slab, objs[99] + 8) == -1;
+	rejected += slab_free(slab, block) == -1;
+	assert(rejected == 3);
+	assert(slab_alloc(slab, 0) == NULL && slab_alloc(slab, SLAB_MAX_OBJECT + 1) == NULL);
+
+	for (int size = 1; size <= SLAB_MAX_OBJECT; size++)
+		freed += slab_free(slab, objs[size - 1]) == 0;
+	assert(freed == SLAB_MAX_OBJECT);
+
+	/* freed twice */
+	assert(slab_free(slab, objs[0]) == -1);
+
+	slab_destroy(slab);
+	buddy_arena_free(arena, block);
+	buddy_stats_t st;
+	buddy_arena_stats(arena, &st);
+	assert(st.bytes_allocated == 0);
+	buddy_destroy(arena);
+	free(mem);
+	printf("slab checks ok\n");
+}
+
+static void run(const char *name, int use_slab)
+{
+	void *mem = malloc(ARENA_SIZE);
+	buddy_t *arena = buddy_create(mem, ARENA_SIZE, MIN_ORDER);
+	slab_allocator_t *slab = use_slab ? slab_create(arena) : NULL;
+	unsigned int seed = 1;
+
+	assert(arena != NULL && (!use_slab || slab != NULL));
+	unsigned long ops_before = buddy_ops(arena);
+
+	double start = now_ns();
+	for (int i = 0; i < OPERATIONS; i++) {
+		int slot = rand_r(&seed) % LIVE_SLOTS;
+
+		if (live[slot] != NULL) {
+			if (use_slab)
+				slab_free(slab, live[slot]);
+			else
+				buddy_arena_free(arena, live[slot]);
+			live[slot] = NULL;
+		} else {
+			sizes[slot] = 32 + rand_r(&seed) % 481;
+			live[slot] = use_slab ? slab_alloc(slab, sizes[slot]) :
+				buddy_arena_alloc(arena, sizes[slot]);
+			assert(live[slot] != NULL);
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	buddy_stats_t st;
+	size_t requested = 0;
+	buddy_arena_stats(arena, &st);
+	for (int slot = 0; slot < LIVE_SLOTS; slot++)
+		if (live[slot] != NULL)
+			requested += sizes[slot];
+
+	printf("%s,%zu,%zu,%.1f,%.1f,%lu\n", name, requested, st.bytes_allocated,
+	       100.0 * (st.bytes_allocated - requested) / st.bytes_allocated,
+	       elapsed / OPERATIONS, buddy_ops(arena) - ops_before);
+
+	for (int slot = 0; slot < LIVE_SLOTS; slot++) {
+		if (live[slot] != NULL) {
+			if (use_slab)
+				slab_free(slab, live[slot]);
+			else
+				buddy_arena_free(arena, live[slot]);
+			live[slot] = NULL;
+		}
+	}
+	slab_destroy(slab);
+	buddy_destroy(arena);
+	free(mem);
+}
+
+int main()
+{
+	check_slab();
+	printf("allocator,live_bytes,arena_bytes,waste_pct,ns_per_op,buddy_ops\n");
+	run("buddy", 0);
+	run("slab", 1);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/**
+ * Snapshot benchmark
+ *
+ * Warms up an arena by allocating blocks of 4-64 KiB until half of it is in
+ * use and filling every block, writes it to a snapshot file and restores it.
+ * Reports the time of the warm-up, the snapshot, the restore and of the
+ * first pass over the restored blocks, which faults them in from the file.
+ * The restored arena must be consistent, hold the same free bytes and the
+ * same data, and keep working.
+ *
+ * Usage: ./bench_snapshot [snapshot file]
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (256UL << 20)
+#define MIN_ORDER 12
+#define MAX_BLOCKS 65536
+
+static size_t offsets[MAX_BLOCKS];
+static size_t sizes[MAX_BLOCKS];
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* stamp every word of a block with its offset */
+static void fill(uint64_t *block, size_t size, size_t offset)
+{
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+		block[i] = offset + i;
+}
+
+static void check(const uint64_t *block, size_t size, size_t offset)
+{
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		if (block[i] != offset + i) {
+			fprintf(stderr, "block at %zu corrupted\n", offset);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "bench_snapshot.img";
+	buddy_t *arena = buddy_create_mapped(ARENA_SIZE, MIN_ORDER, -1, 0);
+	size_t used = 0;
+	int n = 0;
+
+	assert(arena != NULL);
+	srand(1);
+	double t0 = now();
+	while (used < ARENA_SIZE / 2 && n < MAX_BLOCKS) {
+		size_t size = (size_t)(1 + rand() % 16) << MIN_ORDER;
+		void *block = buddy_arena_alloc(arena, size);
+
+		assert(block != NULL);
+		offsets[n] = buddy_offset(arena, block);
+		sizes[n] = size;
+		fill(block, size, offsets[n]);
+		used += size;
+		n++;
+	}
+	double warm = now() - t0;
+	long free_bytes = buddy_arena_check(arena);
+	assert(free_bytes >= 0);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	assert(fd >= 0);
+	t0 = now();
+	assert(buddy_arena_snapshot(arena, fd) == 0);
+	fsync(fd);
+	double snap = now() - t0;
+	buddy_destroy(arena);
+
+	t0 = now();
+	buddy_t *restored = buddy_arena_restore(fd);
+	double restore = now() - t0;
+	assert(restored != NULL);
+	close(fd);
+	unlink(path);
+
+	t0 = now();
+	for (int i = 0; i < n; i++)
+		check(buddy_address(restored, offsets[i]), sizes[i], offsets[i]);
+	double touch = now() - t0;
+
+	if (buddy_arena_check(restored) != free_bytes) {
+		fprintf(stderr, "restored arena is inconsistent\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < n; i++)
+		assert(buddy_arena_free(restored, buddy_address(restored, offsets[i])) == 0);
+	assert(buddy_arena_check(restored) == (long)ARENA_SIZE);
+	buddy_destroy(restored);
+
+	printf("blocks,warmup_ms,snapshot_ms,restore_ms,first_touch_ms\n");
+	printf("%d,%.2f,%.2f,%.3f,%.2f\n", n, warm * 1e3, snap * 1e3, restore * 1e3, touch * 1e3);
+	return EXIT_SUCCESS;
+}
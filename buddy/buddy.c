@@ -1,7 +1,7 @@
 /**
  * Buddy Allocator
  *
- * For the list library usage, see http://www.mcs.anl.gov/~kazutomo/list/
+ * Free lists are doubly linked through the page descriptors by page index.
  */
 
 
@@ -10,34 +10,181 @@
  **************************************************************************/
 #define USE_DEBUG 0
 
+/* Thread safe arenas: a lock around the buddy core plus per-CPU magazines
+ * of small free blocks in front of it. Build with -DUSE_THREADS=1 */
+#ifndef USE_THREADS
+#define USE_THREADS 0
+#endif
+
+/* Lock free arenas: every free list is a Treiber stack and blocks are
+ * claimed with CAS on per-block state. Build with -DUSE_LOCKFREE=1 */
+#ifndef USE_LOCKFREE
+#define USE_LOCKFREE 0
+#endif
+
+/* Allocation, split and merge counters behind buddy_stats(). The free
+ * block counts are kept either way. Build with -DUSE_STATS=0 to drop them */
+#ifndef USE_STATS
+#define USE_STATS 1
+#endif
+
+/* Abort with a message on an invalid free instead of counting and ignoring
+ * it. Build with -DUSE_HARDENED=1 */
+#ifndef USE_HARDENED
+#define USE_HARDENED 0
+#endif
+
+#if USE_THREADS && USE_LOCKFREE
+#error "USE_THREADS and USE_LOCKFREE are alternative builds"
+#endif
+
 /**************************************************************************
  * Included Files
  **************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if USE_THREADS
+#include <sched.h>
+#endif
+
+#if USE_LOCKFREE
+#include <stdatomic.h>
+#endif
+#include <stdint.h>
 
 
 #include "buddy.h"
-#include "list.h"
 
 /**************************************************************************
  * Public Definitions
  **************************************************************************/
 
+/* geometry of the default arena behind buddy_init() */
 #define MIN_ORDER 12
 #define MAX_ORDER 20
 
-#define PAGE_SIZE (1<<MIN_ORDER)
+/* one free list per possible order, indexed by order */
+#define NR_ORDERS (sizeof(unsigned long) * CHAR_BIT)
+
+/* largest order of a block, beyond any address space in use */
+#define ORDER_LIMIT 48
+
+/* the memory, page structures and lock free nodes of an arena are found
+ * relative to its header, so an arena in shared memory works wherever a
+ * process maps it */
+#define MEMORY(b) ((char *)((uintptr_t)(b) + (b)->memory_off))
+#define PAGES(b) ((page_t *)((uintptr_t)(b) + (b)->pages_off))
+#define NODES(b) ((lf_node_t *)((uintptr_t)(b) + (b)->nodes_off))
+
+#define PAGE_SIZE(b) (1UL<<(b)->min_order)
 /* page index to address */
-#define PAGE_TO_ADDR(page_idx) (void *)((page_idx*PAGE_SIZE) + g_memory)
+#define PAGE_TO_ADDR(b, page_idx) (void *)(((unsigned long)(page_idx)*PAGE_SIZE(b)) + MEMORY(b))
+
+/* page descriptor to page index */
+#define PAGE_INDEX(b, page) ((unsigned long)((page) - PAGES(b)))
 
 /* address to page index */
-#define ADDR_TO_PAGE(addr) ((unsigned long)((void *)addr - (void *)g_memory) / PAGE_SIZE)
+#define ADDR_TO_PAGE(b, addr) ((unsigned long)((void *)(addr) - (void *)MEMORY(b)) / PAGE_SIZE(b))
 
 /* find buddy address */
-#define BUDDY_ADDR(addr, o) (void *)((((unsigned long)addr - (unsigned long)g_memory) ^ (1<<o)) \
-									 + (unsigned long)g_memory)
+#define BUDDY_ADDR(b, addr, o) (void *)((((unsigned long)(addr) - (unsigned long)MEMORY(b)) ^ (1UL<<(o))) \
+									 + (unsigned long)MEMORY(b))
+
+/* huge page of the BUDDY_MAP_HUGETLB mappings */
+#define HUGE_PAGE_ORDER 21
+#define HUGE_PAGE_SIZE (1UL << HUGE_PAGE_ORDER)
+
+/* number of per-CPU magazines in an arena, a power of two */
+#define NR_CPU_CACHES 64
+
+/* number of orders, starting at the page order, served from the magazines */
+#ifndef CACHE_ORDERS
+#define CACHE_ORDERS 4
+#endif
+
+/* blocks held per order in one magazine */
+#define MAGAZINE_SIZE 32
+
+#if USE_THREADS && CACHE_ORDERS > 0
+#  define USE_MAGAZINES 1
+#else
+#  define USE_MAGAZINES 0
+#endif
+
+/* whether other threads or processes may use the arena at the same time */
+#if USE_THREADS || USE_LOCKFREE
+#  define CONCURRENT(b) 1
+#else
+#  define CONCURRENT(b) ((b)->shared)
+#endif
+
+/* the lock of the buddy core, taken when the arena is shared */
+#if USE_LOCKFREE
+#  define BUDDY_LOCK(b)
+#  define BUDDY_UNLOCK(b)
+#else
+#  define BUDDY_LOCK(b) do { if (CONCURRENT(b)) buddy_lock(b); } while (0)
+#  define BUDDY_UNLOCK(b) do { if (CONCURRENT(b)) pthread_mutex_unlock(&(b)->lock); } while (0)
+#endif
+
+/* identifies a header set up by buddy_create_shared() */
+#define SHARED_MAGIC 0x62756464796c7374ULL
+
+/* identifies a header written by buddy_arena_snapshot() */
+#define SNAPSHOT_MAGIC 0x62756464796c736eULL
+
+/* end of a free list */
+#define PAGE_NONE UINT32_MAX
+
+/* page state: heads a block sitting on free_area[order] */
+#define PAGE_FREE 1
+
+/* page state: heads a block that is part of a bulk free in progress */
+#define PAGE_PENDING 2
+
+/* page state: heads a block sitting on free_area[order] that its buddy may
+ * not merge with yet, see buddy_arena_set_lazy() */
+#define PAGE_LAZY 3
+
+/* page state: heads an allocated piece of a trimmed block that another piece
+ * follows, see buddy_arena_set_trim() */
+#define PAGE_TRIMMED 4
+
+#if USE_LOCKFREE
+/* lock free node of the block of order o starting at page page_idx */
+#  define NODE_OF(b, o, page_idx) ((b)->node_base[o] + ((unsigned long)(page_idx) >> ((o) - (b)->min_order)))
+
+/* node state: on the stack of its order, possibly as a stale entry */
+#  define NODE_LINKED 1
+/* node state: the block is free */
+#  define NODE_FREE 2
+/* node state bits of the current epoch, above the NODE_LINKED and NODE_FREE bits */
+#  define NODE_EPOCH(b) ((uint32_t)(b)->epoch << 2)
+/* whether a node state stands for a free block in the current epoch */
+#  define NODE_IS_FREE(b, s) (((s) & ~(uint32_t)NODE_LINKED) == (NODE_EPOCH(b) | NODE_FREE))
+#endif
+
+/* add to a counter of b->stats and yield the new value, relaxed atomics when
+ * threads or processes share the arena */
+#define COUNT_ADD(b, field, n) \
+	(CONCURRENT(b) ? __atomic_add_fetch(&(b)->stats.field, (n), __ATOMIC_RELAXED) \
+		       : ((b)->stats.field += (n)))
+
+#if USE_STATS
+#  define STAT_ADD(b, field, n) COUNT_ADD(b, field, n)
+#else
+#  define STAT_ADD(b, field, n)
+#endif
 
 #if USE_DEBUG == 1
 #  define PDEBUG(fmt, ...) \
@@ -52,25 +199,99 @@
 /**************************************************************************
  * Public Types
  **************************************************************************/
+/**
+ * Page descriptor. Only the descriptor of the head page of a block is used;
+ * the index and address of a page follow from its place in the pages array.
+ * A descriptor is only read while it heads a block, and every path that
+ * makes a page the head of a block, free or allocated, writes its order and
+ * state, so none of them needs setting up front or at a reset. The 32 bit
+ * links bound an arena to 2^32 - 1 pages, 16 TiB with 4 KiB pages.
+ */
 typedef struct {
-	struct list_head list;
-	int block_size;
-	/* TODO: DECLARE NECESSARY MEMBER VARIABLsES */
-	int page_index;
-	char* page_address;
+	union {
+		struct {
+			uint32_t prev;   ///< previous page on the free list, PAGE_NONE at the head
+			uint32_t next;   ///< next page on the free list, PAGE_NONE at the tail
+		};
+		/* only 4 byte aligned, which keeps the descriptor at 12 bytes */
+		uint64_t requested __attribute__((packed, aligned(4)));  ///< bytes asked for while the block is allocated
+	};
+	uint8_t order;    ///< order of the block this page heads
+	uint8_t state;    ///< PAGE_FREE or PAGE_LAZY while the block is on a free list, PAGE_PENDING or PAGE_TRIMMED
+	uint16_t live;    ///< epoch of the arena while the block this page heads is handed out
 } page_t;
 
+#if USE_LOCKFREE
+/**
+ * Stack node of one naturally aligned block. A block that is merged away or
+ * allocated straight from its buddy's split stays on its stack as a stale
+ * entry until a pop drops it; freeing it again before that revives the stale
+ * entry instead of pushing it a second time.
+ */
+typedef struct {
+	_Atomic uint32_t next;   ///< next node on the stack plus one, 0 ends the stack
+	_Atomic uint32_t state;  ///< NODE_EPOCH() with the NODE_LINKED and NODE_FREE bits
+} lf_node_t;
+#endif
+
+#if USE_MAGAZINES
+/**
+ * Free blocks of the smallest orders cached for one CPU. Only threads running
+ * on that CPU take its lock, so it is almost never contended.
+ */
+struct magazine {
+	pthread_mutex_t lock;
+	int count[CACHE_ORDERS];                      ///< blocks held per order
+	void *blocks[CACHE_ORDERS][MAGAZINE_SIZE];    ///< stack of blocks per order
+} __attribute__((aligned(64)));
+#endif
+
+/**
+ * One buddy arena. Blocks are aligned to their size relative to memory.
+ */
+struct buddy {
+	uint64_t magic;       ///< SHARED_MAGIC once a shared arena is set up, SNAPSHOT_MAGIC in a snapshot
+	uintptr_t memory_off; ///< start of the managed memory, relative to the header
+	size_t size;          ///< managed bytes, a multiple of the page size
+	int min_order;        ///< order of a page, the smallest block
+	int max_order;        ///< order of the largest block the arena can hold
+	int align_order;      ///< blocks up to this order are aligned absolutely
+	int release_order;    ///< free blocks of this order and up go back to the OS
+	int trim;             ///< 1 to give the pages past the end of a request back
+	size_t map_len;       ///< length of the mapping memory is in, 0 if not owned
+	size_t image_len;     ///< length of the mapping the header and everything behind it are in, 0 if allocated
+	int shared;           ///< 1 while other processes use the arena too
+	unsigned long nr_pages;  ///< number of page structures
+	uintptr_t pages_off;  ///< page structures, relative to the header
+	uint16_t epoch;       ///< live marks and node states of other epochs are stale, see buddy_arena_reset()
+	buddy_stats_t stats;  ///< free block counts and event counters
+#if USE_LOCKFREE
+	uintptr_t nodes_off;                       ///< one node per aligned block of every order, relative to the header
+	unsigned long node_base[NR_ORDERS];        ///< index of the first node of each order
+	_Atomic uint64_t free_stack[NR_ORDERS];    ///< stack heads, ABA tag << 32 | node + 1
+#else
+	unsigned long free_area_mask;              ///< bit o is set while free_area[o] is not empty
+	uint32_t free_area[NR_ORDERS];             ///< first page of each free list
+	int lazy_watermark;                        ///< most PAGE_LAZY blocks per order, 0 merges eagerly
+	uint32_t lazy_count[NR_ORDERS];            ///< PAGE_LAZY blocks per order
+	uint32_t lazy_blocks;                      ///< PAGE_LAZY blocks of all orders
+#endif
+#if !USE_LOCKFREE
+	pthread_mutex_t lock;                      ///< protects the buddy core above, when the arena is shared
+#endif
+#if USE_MAGAZINES
+	struct magazine cpu_cache[NR_CPU_CACHES];  ///< per-CPU caches of small blocks
+#endif
+};
+
 /**************************************************************************
  * Global Variables
  **************************************************************************/
-/* free lists*/
-struct list_head free_area[MAX_ORDER+1];
+/* memory area of the default arena, aligned like its largest block */
+char g_memory[1<<MAX_ORDER] __attribute__((aligned(1<<MAX_ORDER)));
 
-/* memory area */
-char g_memory[1<<MAX_ORDER];
-
-/* page structures */
-page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
+/* default arena used by the buddy_init()/buddy_alloc()/buddy_free() API */
+static buddy_t *g_buddy;
 
 /**************************************************************************
  * Public Function Prototypes
@@ -80,242 +301,2680 @@ page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
  * Local Functions
  **************************************************************************/
 
+#if !USE_LOCKFREE
 /**
- * Initialize the buddy system
+ * Take the lock of the buddy core
+ *
+ * The lock of a shared arena is robust: when a process dies holding it, the
+ * next one to lock gets it anyway. The blocks the dead process held stay
+ * allocated, and an operation it was in the middle of may have left the free
+ * lists broken, which buddy_arena_check() reports.
+ *
+ * @param b arena
  */
-void buddy_init()
+static void buddy_lock(buddy_t *b)
 {
-	int number_pages = (1<<MAX_ORDER) / PAGE_SIZE;
-	/* Loop through the number of pages */
-	for (int i = 0; i < number_pages; i++)
+	if (pthread_mutex_lock(&b->lock) == EOWNERDEAD)
 	{
-		/* set the previous and the next values for the list */
-		(&g_pages[i].list)->next = (&g_pages[i].list);
-		(&g_pages[i].list)->prev = (&g_pages[i].list);
-		/* Start with the MAX_ORDER ortherwise set to MIN_INT */
-		if ( i == 0)
-		{
-			g_pages[i].block_size = MAX_ORDER;
-		}
-		else
+		pthread_mutex_consistent(&b->lock);
+	}
+}
+#endif
+
+#if USE_LOCKFREE
+/**
+ * Push a node on the stack of an order
+ * @param b arena
+ * @param order order of the stack
+ * @param node node index
+ */
+static void lf_push(buddy_t *b, int order, uint32_t node)
+{
+	uint64_t old = atomic_load(&b->free_stack[order]);
+	uint64_t new;
+
+	do {
+		atomic_store(&NODES(b)[node].next, (uint32_t)old);
+		new = (((old >> 32) + 1) << 32) | (node + 1);
+	} while (!atomic_compare_exchange_weak(&b->free_stack[order], &old, new));
+}
+
+/**
+ * Pop a node off the stack of an order
+ *
+ * The tag in the upper half of the head changes on every update, so a head
+ * that was popped and pushed back in between makes the CAS fail.
+ *
+ * @param b arena
+ * @param order order of the stack
+ * @return node index, or -1 if the stack is empty
+ */
+static long lf_pop(buddy_t *b, int order)
+{
+	uint64_t old = atomic_load(&b->free_stack[order]);
+	uint64_t new;
+
+	do {
+		uint32_t top = (uint32_t)old;
+		if (top == 0)
 		{
-			g_pages[i].block_size = INT_MIN;
+			return -1;
 		}
-		/* set the page index */
-		g_pages[i].page_index = i;
-		/* set the page address */
-		g_pages[i].page_address = PAGE_TO_ADDR(i);
+		new = (((old >> 32) + 1) << 32) | atomic_load(&NODES(b)[top - 1].next);
+	} while (!atomic_compare_exchange_weak(&b->free_stack[order], &old, new));
 
-	}
+	return (uint32_t)old - 1;
+}
 
-	/* initialize freelist */
-	for (int i = MIN_ORDER; i <= MAX_ORDER; i++)
+/**
+ * Mark a block free and make sure its node is on the stack of its order
+ * @param b arena
+ * @param page head page of the block
+ * @param order order of the block
+ */
+static void free_block_add(buddy_t *b, page_t *page, int order)
+{
+	uint32_t node = NODE_OF(b, order, PAGE_INDEX(b, page));
+	uint32_t state = atomic_load(&NODES(b)[node].state);
+
+	while (!atomic_compare_exchange_weak(&NODES(b)[node].state, &state,
+					     NODE_EPOCH(b) | NODE_LINKED | NODE_FREE))
+		;
+	/* a stale entry that is still linked comes back to life where it is;
+	 * a node linked in an older epoch is on no stack anymore */
+	COUNT_ADD(b, free_blocks[order], 1);
+	if ((state & ~(uint32_t)NODE_FREE) != (NODE_EPOCH(b) | NODE_LINKED))
 	{
-		INIT_LIST_HEAD(&free_area[i]);
+		lf_push(b, order, node);
 	}
+}
 
-	/* add the entire memory as a freeblock */
-	list_add(&g_pages[0].list, &free_area[MAX_ORDER]);
+/**
+ * Claim a specific free block for merging. Its node stays on the stack as a
+ * stale entry.
+ * @param b arena
+ * @param order order of the block
+ * @param index head page of the block
+ * @return 1 if the block was free and now belongs to the caller
+ */
+static int free_block_claim(buddy_t *b, int order, long index)
+{
+	uint32_t expected = NODE_EPOCH(b) | NODE_LINKED | NODE_FREE;
+	if (!atomic_compare_exchange_strong(&NODES(b)[NODE_OF(b, order, index)].state,
+					    &expected, NODE_EPOCH(b) | NODE_LINKED))
+	{
+		return 0;
+	}
+	COUNT_ADD(b, free_blocks[order], -1UL);
+	return 1;
 }
 
- /**
-  * Split a block of memory and update the free list with the buddy
-  * @param order order of memory size
-  * @param index of the page
-  */
-void split(int order,int index)
+/**
+ * Take any free block of an order, dropping stale entries on the way
+ * @param b arena
+ * @param order order of the block
+ * @return head page of the block, or -1 if there is none
+ */
+static long free_block_take(buddy_t *b, int order)
 {
-	page_t* buddy = &g_pages[ADDR_TO_PAGE(BUDDY_ADDR(PAGE_TO_ADDR(index), order))];
-	list_add(&(buddy->list),&free_area[order]);
+	for (;;)
+	{
+		long node = lf_pop(b, order);
+		if (node < 0)
+		{
+			return -1;
+		}
+		/* the node is off the stack now; the block is ours if it was free */
+		if (NODE_IS_FREE(b, atomic_exchange(&NODES(b)[node].state, 0)))
+		{
+			COUNT_ADD(b, free_blocks[order], -1UL);
+			return (node - b->node_base[order]) << (order - b->min_order);
+		}
+	}
 }
+#else
+/**
+ * Put a block on the free list of its order and mark its head page free
+ * @param b arena
+ * @param page head page of the block
+ * @param order order of the block
+ */
+static void free_block_add(buddy_t *b, page_t *page, int order)
+{
+	uint32_t index = PAGE_INDEX(b, page);
+	uint32_t head = b->free_area[order];
 
+	page->order = order;
+	page->state = PAGE_FREE;
+	page->prev = PAGE_NONE;
+	page->next = head;
+	if (head != PAGE_NONE)
+	{
+		PAGES(b)[head].prev = index;
+	}
+	b->free_area[order] = index;
+	b->free_area_mask |= 1UL << order;
+	COUNT_ADD(b, free_blocks[order], 1);
+}
 
 /**
- * Allocate a memory block.
- *
- * On a memory request, the allocator returns the head of a free-list of the
- * matching size (i.e., smallest block that satisfies the request). If the
- * free-list of the matching block size is empty, then a larger block size will
- * be selected. The selected (large) block is then splitted into two smaller
- * blocks. Among the two blocks, left block will be used for allocation or be
- * further splitted while the right block will be added to the appropriate
- * free-list.
- *
- * @param size size in bytes
- * @return memory block address
+ * Take a block off its free list and clear the free mark on its head page
+ * @param b arena
+ * @param page head page of the block
  */
-void *buddy_alloc(int size)
+static void free_block_del(buddy_t *b, page_t *page)
 {
-	//Check if the size is possible
-	if(size > order_to_bytes(MAX_ORDER))
+	int order = page->order;
+
+	if (page->prev != PAGE_NONE)
 	{
-		#if USE_DEBUG
-			printf("%s\n","Error this won't Work" );
-		#endif
-		return NULL;
+		PAGES(b)[page->prev].next = page->next;
 	}
-	else if (size < 1)
+	else
 	{
-		#if USE_DEBUG
-			printf("%s\n","Error this won't Work" );
-		#endif
-		return NULL;
+		b->free_area[order] = page->next;
 	}
-
-	/* Used to store the minimal order for allocation*/
-	int alloc_size = MIN_ORDER;
-	/* This is used to find the smallest block size possible */
-	while(size > order_to_bytes(alloc_size) && alloc_size < MAX_ORDER)
+	if (page->next != PAGE_NONE)
+	{
+		PAGES(b)[page->next].prev = page->prev;
+	}
+	if (page->state == PAGE_LAZY)
+	{
+		b->lazy_count[order]--;
+		b->lazy_blocks--;
+	}
+	page->state = 0;
+	if (b->free_area[order] == PAGE_NONE)
 	{
-		alloc_size++;
+		b->free_area_mask &= ~(1UL << order);
 	}
+	COUNT_ADD(b, free_blocks[order], -1UL);
+}
 
-	#if USE_DEBUG
-		printf("Alloc size: %d\n",alloc_size);
-	#endif
+#endif
+
+/**
+ * Number of free blocks of an order, from the counter kept by the free lists
+ * @param b arena
+ * @param order order of the blocks
+ */
+static unsigned long free_block_count(buddy_t *b, int order)
+{
+	return __atomic_load_n(&b->stats.free_blocks[order], __ATOMIC_RELAXED);
+}
 
-	/* Used to find the smallest free block available */
-	int min_block_size = alloc_size;
-	/* Loop to find the appropriate value */
-	while(list_empty(&free_area[min_block_size]) && min_block_size < MAX_ORDER)
+/**
+ * Hand the memory of a free block back to the OS if it is large enough.
+ * Must run before the block is published on a free list, where another
+ * thread could take it and write to it.
+ * @param b arena
+ * @param index head page of the block
+ * @param order order of the block
+ */
+static void buddy_release(buddy_t *b, long index, int order)
+{
+	if (order >= b->release_order)
 	{
-		min_block_size++;
+		madvise(PAGE_TO_ADDR(b, index), 1UL << order, MADV_DONTNEED);
 	}
+}
 
-	#if USE_DEBUG
-		printf("Block size: %d\n",min_block_size);
-	#endif
+/**
+ * Bytes an allocated block spans, over all of its pieces if it was trimmed
+ * @param b arena
+ * @param index head page of the block
+ */
+static size_t block_bytes(buddy_t *b, long index)
+{
+	size_t bytes = 0;
 
-	if(min_block_size == MAX_ORDER && list_empty(&free_area[MAX_ORDER]))
+	for (;;)
 	{
-		return NULL;
+		page_t *page = &PAGES(b)[index];
+
+		bytes += 1UL << page->order;
+		if (page->state != PAGE_TRIMMED)
+		{
+			return bytes;
+		}
+		index += 1L << (page->order - b->min_order);
 	}
+}
 
-	/* Update the free list for the block that we are allocating */
-	page_t* page = list_entry(free_area[min_block_size].next, page_t, list);
-	int index = page->page_index;
-	list_del_init(&(page->list));
+#if USE_STATS
+/**
+ * Account for blocks handed out to the caller and remember how much of each
+ * block was asked for
+ * @param b arena
+ * @param addrs block addresses
+ * @param n number of blocks
+ * @param order order of the blocks, of their first pieces if they were trimmed
+ * @param size bytes requested per block
+ */
+static void stats_alloc(buddy_t *b, void **addrs, int n, int order, size_t size)
+{
+	size_t bytes = 0;
 
-	/* If the smallest free block size is bigger than the allocation size, split it up */
-	while(min_block_size > alloc_size)
+	for (int i = 0; i < n; i++)
 	{
-		min_block_size--;
-		split(min_block_size,index);
+		long index = ADDR_TO_PAGE(b, addrs[i]);
+
+		PAGES(b)[index].requested = size;
+		bytes += block_bytes(b, index);
 	}
 
-	/* Update the block size and return the address */
-	page->block_size = alloc_size;
-	return PAGE_TO_ADDR (page->page_index);
+	size_t now = COUNT_ADD(b, bytes_allocated, bytes);
+	size_t peak = __atomic_load_n(&b->stats.peak_bytes_allocated, __ATOMIC_RELAXED);
+	COUNT_ADD(b, bytes_requested, (size_t)n * size);
+	COUNT_ADD(b, allocs[order], n);
+	while (now > peak && !__atomic_compare_exchange_n(&b->stats.peak_bytes_allocated, &peak, now,
+							  1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
 }
 
 /**
- * Converts order to number of bytes, basically 2 to the nth power
- * @param order order of memory size
- * @return memory size in bytes
+ * Account for a block given back by the caller
+ * @param b arena
+ * @param page head page of the block, still allocated
  */
-int order_to_bytes(int order)
+static void stats_free(buddy_t *b, page_t *page)
 {
-	return (1 << order);
+	COUNT_ADD(b, bytes_allocated, -block_bytes(b, PAGE_INDEX(b, page)));
+	COUNT_ADD(b, bytes_requested, -(size_t)page->requested);
+	COUNT_ADD(b, frees[page->order], 1);
 }
+#else
+#  define stats_alloc(b, addrs, n, order, size)
+#  define stats_free(b, page)
+#endif
 
 /**
- * Finds the available space for buddy
- *
- * Name: whereisavialable(int size, void* addr)
+ * Mark the head pages of blocks handed out to the caller live
+ * @param b arena
+ * @param addrs block addresses
+ * @param n number of blocks
  */
-page_t* whereisavialable(int size, void* addr)
+static void mark_live(buddy_t *b, void **addrs, int n)
 {
-	/* Create a list that we will iterate through in search of similiar sized free area*/
-	struct list_head* l;
-	/* initialize a page which will be the return variable */
-	page_t * page = NULL;
-	/* iterate over the free_area list */
-	for (l = (&free_area[size])->next; l != (&free_area[size]); l = l->next)
+	for (int i = 0; i < n; i++)
 	{
-		/* temporarily set a page variable equal to the current list entry */
-		page = list_entry(l, page_t, list);
+		PAGES(b)[ADDR_TO_PAGE(b, addrs[i])].live = b->epoch;
+	}
+}
 
-		/* check if the list entry size is the same as buddy's size */
-		if (page->page_address == BUDDY_ADDR(addr , size))
-		{
-			/*return the list entry which is the same size as buddy's*/
-			return page;
-		}
+/**
+ * Page an address given back by the caller starts
+ * @param b arena
+ * @param addr the address
+ * @return page index, or -1 if addr is outside the arena or not at the start
+ * of a page
+ */
+static long addr_to_page_checked(buddy_t *b, void *addr)
+{
+	unsigned long offset = (unsigned long)addr - (unsigned long)MEMORY(b);
+
+	if (offset >= b->size || (offset & (PAGE_SIZE(b) - 1)) != 0)
+	{
+		return -1;
 	}
-	/* return NULL if there is no similiarly sized list entries */
-	return NULL;
+	return offset >> b->min_order;
 }
+
 /**
- * Free an allocated memory block.
+ * Report a free of an address that is not a live block
+ * @param b arena
+ * @param addr the address
+ */
+static void invalid_free(buddy_t *b, void *addr)
+{
+	COUNT_ADD(b, invalid_frees, 1);
+#if USE_HARDENED
+	fprintf(stderr, "buddy: invalid free of %p\n", addr);
+	abort();
+#else
+	(void)addr;
+#endif
+}
+
+/**
+ * Take the live mark off the block a free gives back
  *
- * Whenever a block is freed, the allocator checks its buddy. If the buddy is
- * free as well, then the two buddies are combined to form a bigger block. This
- * process continues until one of the buddies is not free.
+ * Only the head page of a block handed out carries the mark of the current
+ * epoch, so a pointer outside the arena or into the middle of a block, and a
+ * block that is free already or was dropped by a reset, are all turned away
+ * with one lookup. When threads or processes share the arena the mark is
+ * taken atomically, so of two racing frees of a block one fails.
  *
- * @param addr memory block address to be freed
+ * @param b arena
+ * @param addr address passed to the free
+ * @return head page of the block, or -1 if the free is invalid
  */
-void buddy_free(void *addr)
+static long claim_live(buddy_t *b, void *addr)
 {
-	/* Initialize variable to iterate and keep track of location */
-	/* Create a variable to house buddy's address */
-	int buddy_address = ADDR_TO_PAGE(addr);
-	/* Create a variable to house the block size , which will be incremented */
-	int buddy_block_size = g_pages[buddy_address].block_size;
-	/* Create a page_t variable to house the location of whether buddy has a similiar size address */
-	page_t * current_page;
+	long index = addr_to_page_checked(b, addr);
+	int live = 0;
 
-
-	/* loop through the possible values that the block size could be */
-	while(buddy_block_size <= MAX_ORDER)
+	if (index >= 0)
 	{
-		/* get the location of a same sized list item */
-		current_page = whereisavialable(buddy_block_size,addr);
-
-		/* if there is no same sized location */
-		if ( current_page == NULL )
+		if (CONCURRENT(b))
 		{
-			list_add(&g_pages[buddy_address].list, &free_area[buddy_block_size]);
-			return;
+			live = __atomic_exchange_n(&PAGES(b)[index].live, 0, __ATOMIC_RELAXED);
 		}
-		// an entry was found that is the same size as buddy
 		else
 		{
-			#if USE_DEBUG
-				printf("%s%i\n","addr:",(int)addr );
-			#endif
-			#if USE_DEBUG
-				printf("%s%i\n","current_page->page_address:",(int)current_page->page_address );
-			#endif
-			/* increment the address */
-			if( (char*) addr > current_page->page_address )
-			{
-				addr = current_page->page_address;
-				buddy_address = ADDR_TO_PAGE(current_page->page_address);
-			}
-			/* Delete the current list entry */
-			list_del(&(current_page->list));
-			/* check the next size up of the block sizes */
-			buddy_block_size = buddy_block_size + 1;
+			live = PAGES(b)[index].live;
+			PAGES(b)[index].live = 0;
 		}
 	}
+	if (live != b->epoch)
+	{
+		invalid_free(b, addr);
+		return -1;
+	}
+	return index;
 }
 
+/**
+ * Work out the geometry of an arena over a memory region
+ * @param len length of the memory region in bytes
+ * @param min_order order of the smallest block handed out
+ * @param nr_pages receives the number of pages
+ * @param max_order receives the order of the largest block that fits
+ * @return 0, or -1 if no arena fits the arguments
+ */
+static int arena_geometry(size_t len, int min_order, unsigned long *nr_pages, int *max_order)
+{
+	if (min_order < 0 || min_order > ORDER_LIMIT || len < (1UL << min_order) ||
+	    (len >> min_order) >= PAGE_NONE)
+	{
+		return -1;
+	}
+
+	*nr_pages = len >> min_order;
+	*max_order = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(*nr_pages << min_order);
+	if (*max_order > ORDER_LIMIT)
+	{
+		*max_order = ORDER_LIMIT;
+	}
+	return 0;
+}
 
 /**
- * Print the buddy system status---order oriented
- *
- * print free pages in each order.
+ * Bytes of metadata an arena keeps outside its header: the page structures,
+ * followed in the lock free build by the stack nodes
+ * @param nr_pages number of pages
+ * @param min_order order of a page
+ * @param max_order order of the largest block
+ * @return the size, or 0 if the nodes cannot be indexed
  */
-void buddy_dump()
+static size_t arena_meta_size(unsigned long nr_pages, int min_order, int max_order)
 {
-	int o;
-	for (o = MIN_ORDER; o <= MAX_ORDER; o++) {
-		struct list_head *pos;
-		int cnt = 0;
-		list_for_each(pos, &free_area[o]) {
-			cnt++;
-		}
-		printf("%d:%dK ", cnt, (1<<o)/1024);
+	size_t size = nr_pages * sizeof(page_t);
+#if USE_LOCKFREE
+	/* one node per aligned block of every order */
+	unsigned long nr_nodes = 0;
+	for (int o = min_order; o <= max_order; o++)
+	{
+		nr_nodes += (nr_pages + (1UL << (o - min_order)) - 1) >> (o - min_order);
+	}
+	if (nr_nodes >= UINT32_MAX)
+	{
+		return 0;
+	}
+	size += nr_nodes * sizeof(lf_node_t);
+#else
+	(void)min_order;
+	(void)max_order;
+#endif
+	return size;
+}
+
+/**
+ * Lay out an arena image: the header, the metadata behind it, then the memory
+ * on a page boundary, all addressed by offset from the header
+ * @param nr_pages number of pages
+ * @param min_order order of a page
+ * @param meta_size bytes of metadata, see arena_meta_size()
+ * @param meta_off receives the offset of the metadata
+ * @param memory_off receives the offset of the memory
+ * @return length of the image
+ */
+static size_t arena_image_layout(unsigned long nr_pages, int min_order, size_t meta_size,
+				 size_t *meta_off, size_t *memory_off)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	*meta_off = (sizeof(buddy_t) + 63) & ~63UL;
+	*memory_off = (*meta_off + meta_size + page_size - 1) & ~(page_size - 1);
+	return *memory_off + ((size_t)nr_pages << min_order);
+}
+
+/**
+ * Put the whole region of an arena on the free lists, as the largest aligned
+ * blocks that fit
+ *
+ * Only the head pages of those blocks are written. Every other page
+ * structure is left as it is: it is not reachable from a free list, and a
+ * live mark or lock free node state it still holds belongs to an older
+ * epoch, so it is not read until a split or an allocation writes it anew.
+ *
+ * @param b arena header, set up by arena_init()
+ */
+static void arena_fill(buddy_t *b)
+{
+	memset(&b->stats, 0, sizeof(b->stats));
+#if USE_LOCKFREE
+	for (int o = b->min_order; o <= b->max_order; o++)
+	{
+		atomic_store(&b->free_stack[o], 0);
+	}
+#else
+	/* initialize freelist */
+	for (int i = 0; i < (int)NR_ORDERS; i++)
+	{
+		b->free_area[i] = PAGE_NONE;
+		b->lazy_count[i] = 0;
+	}
+	b->free_area_mask = 0;
+	b->lazy_blocks = 0;
+#endif
+
+	size_t offset = 0;
+	while (offset < b->size)
+	{
+		int order = b->max_order;
+		while ((offset & ((1UL << order) - 1)) != 0 || offset + (1UL << order) > b->size)
+		{
+			order--;
+		}
+		free_block_add(b, &PAGES(b)[offset >> b->min_order], order);
+		offset += 1UL << order;
+	}
+}
+
+/**
+ * Set up an arena header and put the whole region on the free lists
+ * @param b arena header
+ * @param meta zeroed metadata of arena_meta_size() bytes
+ * @param mem start of the memory region
+ * @param nr_pages number of pages, see arena_geometry()
+ * @param min_order order of a page
+ * @param max_order order of the largest block
+ * @param shared 1 for an arena in shared memory, 0 for one of this process only
+ */
+static void arena_init(buddy_t *b, void *meta, void *mem, unsigned long nr_pages, int min_order,
+		       int max_order, int shared)
+{
+	b->memory_off = (uintptr_t)mem - (uintptr_t)b;
+	b->pages_off = (uintptr_t)meta - (uintptr_t)b;
+	b->min_order = min_order;
+	b->max_order = max_order;
+	b->nr_pages = nr_pages;
+	b->size = (size_t)nr_pages << min_order;
+	/* blocks are aligned relative to memory, so absolutely only as far as it is */
+	b->align_order = __builtin_ctzl((unsigned long)mem);
+	if (b->align_order > b->max_order)
+	{
+		b->align_order = b->max_order;
+	}
+	b->release_order = INT_MAX;
+	b->trim = 0;
+	b->map_len = 0;
+	b->image_len = 0;
+	b->shared = shared;
+	b->magic = 0;
+	/* the zeroed metadata holds no live mark or node state of epoch 1 */
+	b->epoch = 1;
+
+#if USE_LOCKFREE
+	/* the nodes follow the page structures, each order packed together */
+	unsigned long nr_nodes = 0;
+	b->nodes_off = b->pages_off + nr_pages * sizeof(page_t);
+	for (int o = min_order; o <= max_order; o++)
+	{
+		b->node_base[o] = nr_nodes;
+		nr_nodes += (nr_pages + (1UL << (o - min_order)) - 1) >> (o - min_order);
+		atomic_init(&b->free_stack[o], 0);
+	}
+#else
+	b->lazy_watermark = 0;
+
+	/* a robust lock, so that a process dying inside the allocator does not
+	 * hang the others */
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	if (shared)
+	{
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	pthread_mutex_init(&b->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
+
+	arena_fill(b);
+
+#if USE_MAGAZINES
+	for (int i = 0; i < NR_CPU_CACHES; i++)
+	{
+		pthread_mutex_init(&b->cpu_cache[i].lock, NULL);
+		memset(b->cpu_cache[i].count, 0, sizeof(b->cpu_cache[i].count));
+	}
+#endif
+}
+
+/**
+ * Create a buddy arena on top of a caller supplied memory region
+ *
+ * The region is carved into naturally aligned power of two blocks, so any
+ * length works; only the tail that is smaller than a page is left unused.
+ * Blocks are aligned relative to mem, so mem should be aligned to the
+ * largest alignment buddy_arena_alloc_aligned() is asked for.
+ * The page structures are allocated separately and released by
+ * buddy_destroy(), the memory itself stays owned by the caller.
+ *
+ * @param mem start of the memory region
+ * @param len length of the memory region in bytes
+ * @param min_order order of the smallest block handed out
+ * @return the new arena, or NULL if the arguments are unusable or out of memory
+ */
+buddy_t *buddy_create(void *mem, size_t len, int min_order)
+{
+	unsigned long nr_pages;
+	int max_order;
+
+	if (mem == NULL || arena_geometry(len, min_order, &nr_pages, &max_order) != 0)
+	{
+		return NULL;
+	}
+
+	size_t meta_size = arena_meta_size(nr_pages, min_order, max_order);
+	if (meta_size == 0)
+	{
+		return NULL;
+	}
+
+	buddy_t *b = aligned_alloc(64, (sizeof(*b) + 63) & ~63UL);
+	if (b == NULL)
+	{
+		return NULL;
+	}
+
+	/* no page heads a block yet */
+	void *meta = calloc(1, meta_size);
+	if (meta == NULL)
+	{
+		free(b);
+		return NULL;
+	}
+
+	arena_init(b, meta, mem, nr_pages, min_order, max_order, 0);
+	return b;
+}
+
+/**
+ * Release the page structures of an arena
+ *
+ * An arena in shared memory is only unmapped from the calling process; it
+ * lives on for the other processes until its name is removed with
+ * shm_unlink() and the last of them has let go of it. A restored arena is
+ * unmapped from its snapshot file.
+ *
+ * @param b arena to destroy, may be NULL
+ */
+void buddy_destroy(buddy_t *b)
+{
+	if (b == NULL)
+	{
+		return;
+	}
+	if (b->shared)
+	{
+		munmap(b, b->image_len);
+		return;
+	}
+#if !USE_LOCKFREE
+	pthread_mutex_destroy(&b->lock);
+#endif
+#if USE_MAGAZINES
+	for (int i = 0; i < NR_CPU_CACHES; i++)
+	{
+		pthread_mutex_destroy(&b->cpu_cache[i].lock);
+	}
+#endif
+	if (b->map_len != 0)
+	{
+		munmap(MEMORY(b), b->map_len);
+	}
+	if (b->image_len != 0)
+	{
+		munmap(b, b->image_len);
+		return;
+	}
+	free(PAGES(b));
+	free(b);
+}
+
+/**
+ * Create a buddy arena on its own anonymous mapping
+ *
+ * The mapping reserves no swap and is aligned to the largest block, so pages
+ * are only committed once a block is touched and buddy_arena_alloc_aligned()
+ * works up to the arena size. Free blocks that coalesce to release_order or
+ * above are handed back with MADV_DONTNEED, so the arena shrinks in RSS when
+ * it goes idle. buddy_destroy() unmaps the memory.
+ *
+ * @param len arena size in bytes
+ * @param min_order order of the smallest block handed out
+ * @param release_order order from which free blocks are returned to the OS,
+ * or -1 to keep everything
+ * @param flags BUDDY_MAP_HUGETLB and BUDDY_MAP_THP
+ * @return the new arena, or NULL if the arguments are unusable or the mapping
+ * failed
+ */
+buddy_t *buddy_create_mapped(size_t len, int min_order, int release_order, int flags)
+{
+	if (len == 0)
+	{
+		return NULL;
+	}
+
+	int max_order = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(len);
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	size_t align = 1UL << (max_order < ORDER_LIMIT ? max_order : ORDER_LIMIT);
+	size_t map_len = len;
+
+	if (flags & BUDDY_MAP_HUGETLB)
+	{
+		/* huge pages come aligned, and can only be dropped whole */
+		map_flags |= MAP_HUGETLB;
+		map_len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		align = HUGE_PAGE_SIZE;
+		if (release_order >= 0 && release_order < HUGE_PAGE_ORDER)
+		{
+			release_order = HUGE_PAGE_ORDER;
+		}
+	}
+
+	/* map one extra block to cut an aligned arena out of */
+	size_t extra = (flags & BUDDY_MAP_HUGETLB) ? 0 : align;
+	char *map = mmap(NULL, map_len + extra, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+	char *mem = (char *)(((unsigned long)map + align - 1) & ~(align - 1));
+	if (mem > map)
+	{
+		munmap(map, mem - map);
+	}
+	if (map + map_len + extra > mem + map_len)
+	{
+		munmap(mem + map_len, map + map_len + extra - (mem + map_len));
+	}
+
+	if (flags & BUDDY_MAP_THP)
+	{
+		madvise(mem, map_len, MADV_HUGEPAGE);
+	}
+
+	buddy_t *b = buddy_create(mem, len, min_order);
+	if (b == NULL)
+	{
+		munmap(mem, map_len);
+		return NULL;
+	}
+	b->map_len = map_len;
+	b->release_order = release_order >= 0 ? release_order : INT_MAX;
+	return b;
+}
+
+/**
+ * Create a buddy arena in named shared memory
+ *
+ * The header, the page structures and the memory all sit in one shm_open()
+ * object, and the header finds the rest by offset, so every process that
+ * opens the arena with buddy_open_shared() can allocate and free in it
+ * wherever the object is mapped. The arena has a process-shared robust
+ * lock, and allocations skip the per-CPU magazines. Blocks are aligned to
+ * the system page size at most. Pass blocks between processes as
+ * buddy_offset() and turn them back with buddy_address(). All processes
+ * must use the same build of the allocator.
+ *
+ * @param name name of the shared memory object, "/name"; it must not exist yet
+ * @param len arena size in bytes
+ * @param min_order order of the smallest block handed out
+ * @return the new arena, or NULL if the arguments are unusable or the object
+ * cannot be created, with errno set
+ */
+buddy_t *buddy_create_shared(const char *name, size_t len, int min_order)
+{
+	unsigned long nr_pages;
+	int max_order;
+
+	if (arena_geometry(len, min_order, &nr_pages, &max_order) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t meta_size = arena_meta_size(nr_pages, min_order, max_order);
+	if (meta_size == 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t meta_off, memory_off;
+	size_t image_len = arena_image_layout(nr_pages, min_order, meta_size, &meta_off, &memory_off);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	char *map = MAP_FAILED;
+	if (ftruncate(fd, image_len) == 0)
+	{
+		map = mmap(NULL, image_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		int err = errno;
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+
+	/* a new object reads as zeros, which is what the page structures want */
+	buddy_t *b = (buddy_t *)map;
+	arena_init(b, map + meta_off, map + memory_off, nr_pages, min_order, max_order, 1);
+	b->image_len = image_len;
+	/* only the page alignment of the mapping holds in every process */
+	b->align_order = __builtin_ctzl(page_size);
+	if (b->align_order > b->max_order)
+	{
+		b->align_order = b->max_order;
+	}
+	__atomic_store_n(&b->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+	return b;
+}
+
+/**
+ * Open a buddy arena created by buddy_create_shared() in another process
+ *
+ * @param name name of the shared memory object
+ * @return the arena, or NULL if there is no such object or it does not hold
+ * a complete arena, with errno set
+ */
+buddy_t *buddy_open_shared(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	buddy_t *b = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*b))
+	{
+		b = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	else
+	{
+		errno = EINVAL;
+	}
+	close(fd);
+	if (b == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	/* the creator may not be done yet, or the object is something else */
+	if (__atomic_load_n(&b->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC ||
+	    b->image_len != (size_t)st.st_size)
+	{
+		munmap(b, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return b;
+}
+
+/**
+ * Offset of an address from the start of the arena memory
+ *
+ * A block has the same offset in every process that maps a shared arena, so
+ * offsets can be handed to other processes where pointers cannot.
+ *
+ * @param b arena
+ * @param addr address inside the arena
+ * @return the offset
+ */
+size_t buddy_offset(buddy_t *b, void *addr)
+{
+	return (char *)addr - MEMORY(b);
+}
+
+/**
+ * Address of an offset into the arena memory, see buddy_offset()
+ *
+ * @param b arena
+ * @param offset offset from the start of the arena memory
+ * @return the address
+ */
+void *buddy_address(buddy_t *b, size_t offset)
+{
+	return MEMORY(b) + offset;
+}
+
+/**
+ * Free every block of an arena at once
+ *
+ * The arena goes back to the state buddy_create() left it in, apart from its
+ * lazy coalescing watermark, trim mode and release order, in time independent
+ * of its size and of the number of blocks handed out: the free lists start
+ * over with the few blocks that cover the region, and moving to the next epoch
+ * turns every live mark and lock free node state of the old one stale.
+ * Only when the 16 bit epoch wraps around, once in 65535 resets, are the
+ * page structures cleared. The memory is not handed back to the OS. No other
+ * thread or process may use the arena meanwhile, and every block of it is
+ * invalid afterwards; freeing one counts as an invalid free.
+ *
+ * @param b arena
+ */
+void buddy_arena_reset(buddy_t *b)
+{
+#if USE_MAGAZINES
+	for (int i = 0; i < NR_CPU_CACHES; i++)
+	{
+		struct magazine *m = &b->cpu_cache[i];
+
+		pthread_mutex_lock(&m->lock);
+		memset(m->count, 0, sizeof(m->count));
+		pthread_mutex_unlock(&m->lock);
+	}
+#endif
+	BUDDY_LOCK(b);
+	if (++b->epoch == 0)
+	{
+		memset(PAGES(b), 0, arena_meta_size(b->nr_pages, b->min_order, b->max_order));
+		b->epoch = 1;
+	}
+	arena_fill(b);
+	BUDDY_UNLOCK(b);
+}
+
+/**
+ * Initialize the buddy system
+ *
+ * Creates the default arena over g_memory, or resets it with
+ * buddy_arena_reset(), back to eager coalescing and whole blocks, if it is
+ * there already.
+ */
+void buddy_init()
+{
+	if (g_buddy != NULL && MEMORY(g_buddy) == g_memory)
+	{
+		buddy_arena_reset(g_buddy);
+		buddy_arena_set_lazy(g_buddy, 0);
+		buddy_arena_set_trim(g_buddy, 0);
+		return;
+	}
+	buddy_destroy(g_buddy);
+	g_buddy = buddy_create(g_memory, sizeof(g_memory), MIN_ORDER);
+}
+
+/**
+ * Free every block of the default arena at once, see buddy_arena_reset()
+ */
+void buddy_reset()
+{
+	buddy_arena_reset(g_buddy);
+}
+
+ /**
+  * Split a block of memory and update the free list with the buddy
+  * @param b arena
+  * @param order order of memory size
+  * @param index of the page
+  */
+static void buddy_split(buddy_t *b, int order, unsigned long index)
+{
+	page_t* buddy = &PAGES(b)[ADDR_TO_PAGE(b, BUDDY_ADDR(b, PAGE_TO_ADDR(b, index), order))];
+	free_block_add(b, buddy, order);
+	STAT_ADD(b, splits[order + 1], 1);
+}
+
+ /**
+  * Split a block of memory of the default arena and update the free list with the buddy
+  * @param order order of memory size
+  * @param index of the page
+  */
+void split(int order, unsigned long index)
+{
+	buddy_split(g_buddy, order, index);
+}
+
+#if USE_LOCKFREE
+/**
+ * Take a block of the given order off the free stacks, splitting a larger
+ * one if needed.
+ *
+ * @param b arena
+ * @param alloc_size order of the block
+ * @return memory block address, or NULL if no block is large enough
+ */
+static void *buddy_alloc_order(buddy_t *b, int alloc_size)
+{
+	for (int order = alloc_size; order <= b->max_order; order++)
+	{
+		long index = free_block_take(b, order);
+		if (index < 0)
+		{
+			continue;
+		}
+
+		/* give the right halves back until the block has the right size */
+		while (order > alloc_size)
+		{
+			order--;
+			buddy_split(b, order, index);
+		}
+
+		/* the state may still be PAGE_TRIMMED from before a reset */
+		PAGES(b)[index].order = alloc_size;
+		PAGES(b)[index].state = 0;
+		return PAGE_TO_ADDR(b, index);
+	}
+	return NULL;
+}
+#else
+static int buddy_coalesce_lazy(buddy_t *b);
+
+/**
+ * Take a block of the given order off the free lists, splitting a larger
+ * one if needed. Lazily freed blocks are merged first if nothing large
+ * enough is free. The caller holds the arena lock.
+ *
+ * @param b arena
+ * @param alloc_size order of the block
+ * @return memory block address, or NULL if no block is large enough
+ */
+static void *buddy_alloc_order(buddy_t *b, int alloc_size)
+{
+	/* Mask off the orders that are too small, the lowest bit left is the
+	 * smallest free block available */
+	unsigned long usable = b->free_area_mask & ~((1UL << alloc_size) - 1);
+	if (usable == 0 && buddy_coalesce_lazy(b))
+	{
+		usable = b->free_area_mask & ~((1UL << alloc_size) - 1);
+	}
+	if (usable == 0)
+	{
+		return NULL;
+	}
+	int min_block_size = __builtin_ctzl(usable);
+
+	#if USE_DEBUG
+		printf("Block size: %d\n",min_block_size);
+	#endif
+
+	/* Update the free list for the block that we are allocating */
+	uint32_t index = b->free_area[min_block_size];
+	page_t* page = &PAGES(b)[index];
+	free_block_del(b, page);
+
+	/* If the smallest free block size is bigger than the allocation size, split it up */
+	while(min_block_size > alloc_size)
+	{
+		min_block_size--;
+		buddy_split(b, min_block_size, index);
+	}
+
+	/* Update the block size and return the address */
+	page->order = alloc_size;
+	return PAGE_TO_ADDR(b, index);
+}
+#endif
+
+#if USE_MAGAZINES
+static void buddy_free_block(buddy_t *b, void *addr);
+
+/**
+ * Magazine of the CPU the calling thread runs on
+ * @param b arena
+ */
+static struct magazine *cpu_magazine(buddy_t *b)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+	{
+		cpu = 0;
+	}
+	return &b->cpu_cache[cpu & (NR_CPU_CACHES - 1)];
+}
+
+/**
+ * Return every block held in the magazines to the buddy core
+ * @param b arena
+ */
+static void magazine_drain(buddy_t *b)
+{
+	if (b->shared)
+	{
+		return;
+	}
+	for (int i = 0; i < NR_CPU_CACHES; i++)
+	{
+		struct magazine *m = &b->cpu_cache[i];
+
+		pthread_mutex_lock(&m->lock);
+		BUDDY_LOCK(b);
+		for (int slot = 0; slot < CACHE_ORDERS; slot++)
+		{
+			while (m->count[slot] > 0)
+			{
+				buddy_free_block(b, m->blocks[slot][--m->count[slot]]);
+			}
+		}
+		BUDDY_UNLOCK(b);
+		pthread_mutex_unlock(&m->lock);
+	}
+}
+
+/**
+ * Allocate a small block from the magazine of the current CPU
+ *
+ * An empty magazine is refilled to half capacity with a single trip to the
+ * arena lock. If the core is out of blocks of this size, blocks hoarded by
+ * other CPUs are drained back before giving up.
+ *
+ * @param b arena
+ * @param order order of the block, a cached order
+ * @return memory block address, or NULL if the arena is out of memory
+ */
+static void *magazine_alloc(buddy_t *b, int order)
+{
+	struct magazine *m = cpu_magazine(b);
+	int slot = order - b->min_order;
+	void *addr = NULL;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->count[slot] == 0)
+	{
+		BUDDY_LOCK(b);
+		while (m->count[slot] < MAGAZINE_SIZE / 2)
+		{
+			void *block = buddy_alloc_order(b, order);
+			if (block == NULL)
+			{
+				break;
+			}
+			m->blocks[slot][m->count[slot]++] = block;
+		}
+		BUDDY_UNLOCK(b);
+	}
+	if (m->count[slot] > 0)
+	{
+		addr = m->blocks[slot][--m->count[slot]];
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	if (addr == NULL)
+	{
+		magazine_drain(b);
+		BUDDY_LOCK(b);
+		addr = buddy_alloc_order(b, order);
+		BUDDY_UNLOCK(b);
+	}
+	return addr;
+}
+
+/**
+ * Free a small block into the magazine of the current CPU
+ *
+ * A full magazine gives its older half back to the buddy core with a single
+ * trip to the arena lock.
+ *
+ * @param b arena
+ * @param addr memory block address
+ * @param order order of the block, a cached order
+ */
+static void magazine_free(buddy_t *b, void *addr, int order)
+{
+	struct magazine *m = cpu_magazine(b);
+	int slot = order - b->min_order;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->count[slot] == MAGAZINE_SIZE)
+	{
+		BUDDY_LOCK(b);
+		for (int i = 0; i < MAGAZINE_SIZE / 2; i++)
+		{
+			buddy_free_block(b, m->blocks[slot][i]);
+		}
+		BUDDY_UNLOCK(b);
+		memmove(m->blocks[slot], m->blocks[slot] + MAGAZINE_SIZE / 2,
+			(MAGAZINE_SIZE - MAGAZINE_SIZE / 2) * sizeof(void *));
+		m->count[slot] -= MAGAZINE_SIZE / 2;
+	}
+	m->blocks[slot][m->count[slot]++] = addr;
+	pthread_mutex_unlock(&m->lock);
+}
+#endif
+
+/**
+ * Find the order of the smallest block that holds a request
+ *
+ * The order is the bit length of size - 1, so it takes one count leading
+ * zeros instead of a loop over the orders.
+ *
+ * @param b arena
+ * @param size size in bytes
+ * @return order of the block, or -1 if no block of the arena can hold size
+ */
+static int size_to_order(buddy_t *b, size_t size)
+{
+	if (size == 0 || size > order_to_bytes(b->max_order))
+	{
+		return -1;
+	}
+
+	int order = size > 1 ? (int)(sizeof(size_t) * CHAR_BIT) - __builtin_clzl(size - 1) : 0;
+	return order < b->min_order ? b->min_order : order;
+}
+
+/**
+ * Pages a block must keep for a request, all of them unless the arena trims
+ * @param b arena
+ * @param order order of the block
+ * @param size bytes requested
+ */
+static unsigned long pages_needed(buddy_t *b, int order, size_t size)
+{
+	if (!b->trim)
+	{
+		return 1UL << (order - b->min_order);
+	}
+	return (size + PAGE_SIZE(b) - 1) >> b->min_order;
+}
+
+/**
+ * Give the part of an allocated block past its first pages back
+ *
+ * The pages kept become the largest aligned pieces that fit, in address
+ * order, so a block needs at most one piece per order. The head page of
+ * every piece but the last is marked PAGE_TRIMMED for the free to find the
+ * next piece behind it. Every half that lies wholly past the pages kept is
+ * split off onto its free list, which leaves them to merge back with the
+ * pieces once those are freed. The caller holds the arena lock.
+ *
+ * @param b arena
+ * @param index head page of the block
+ * @param order order of the block
+ * @param pages pages to keep, fewer than the block has
+ */
+static void buddy_trim_block(buddy_t *b, long index, int order, unsigned long pages)
+{
+	while (pages < (1UL << (order - b->min_order)))
+	{
+		order--;
+		unsigned long half = 1UL << (order - b->min_order);
+		if (pages <= half)
+		{
+			/* the upper half is all tail */
+			buddy_release(b, index + half, order);
+			buddy_split(b, order, index);
+		}
+		else
+		{
+			/* the lower half is kept whole, go on in the upper one */
+			PAGES(b)[index].order = order;
+			PAGES(b)[index].state = PAGE_TRIMMED;
+			STAT_ADD(b, splits[order + 1], 1);
+			index += half;
+			pages -= half;
+		}
+	}
+	PAGES(b)[index].order = order;
+	PAGES(b)[index].state = 0;
+}
+
+/**
+ * Hand out a block of an order, through the magazines for small orders
+ * @param b arena
+ * @param order order of the block
+ * @param size bytes requested, for the statistics and for trimming
+ * @return memory block address, or NULL if the arena is out of memory
+ */
+static void *buddy_alloc_block(buddy_t *b, int order, size_t size)
+{
+	unsigned long pages = pages_needed(b, order, size);
+	int trim = pages < (1UL << (order - b->min_order));
+	void *addr;
+#if USE_MAGAZINES
+	/* the magazines belong to the CPUs of one process, and hold whole blocks */
+	if (order < b->min_order + CACHE_ORDERS && !b->shared && !trim)
+	{
+		addr = magazine_alloc(b, order);
+	}
+	else
+#endif
+	{
+		BUDDY_LOCK(b);
+		addr = buddy_alloc_order(b, order);
+		if (addr != NULL && trim)
+		{
+			buddy_trim_block(b, ADDR_TO_PAGE(b, addr), order, pages);
+			order = PAGES(b)[ADDR_TO_PAGE(b, addr)].order;
+		}
+		BUDDY_UNLOCK(b);
+	}
+
+	if (addr == NULL)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		return NULL;
+	}
+	mark_live(b, &addr, 1);
+	stats_alloc(b, &addr, 1, order, size);
+	return addr;
+}
+
+/**
+ * Allocate a memory block.
+ *
+ * On a memory request, the allocator returns the head of a free-list of the
+ * matching size (i.e., smallest block that satisfies the request). If the
+ * free-list of the matching block size is empty, then a larger block size will
+ * be selected. The selected (large) block is then splitted into two smaller
+ * blocks. Among the two blocks, left block will be used for allocation or be
+ * further splitted while the right block will be added to the appropriate
+ * free-list.
+ *
+ * @param b arena
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_arena_alloc(buddy_t *b, size_t size)
+{
+	int alloc_size = size_to_order(b, size);
+	if (alloc_size < 0)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		return NULL;
+	}
+	return buddy_alloc_block(b, alloc_size, size);
+}
+
+/**
+ * Allocate a memory block aligned to a power of two.
+ *
+ * A block of order o is aligned to 2^o relative to the arena memory, so the
+ * block is simply taken at the larger of the size order and log2(align).
+ * That gives absolute alignment as far as the arena memory itself is
+ * aligned, which buddy_create() records.
+ *
+ * @param b arena
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two
+ * @return memory block address, or NULL if out of memory or if the arena
+ * memory is not aligned enough for align
+ */
+void *buddy_arena_alloc_aligned(buddy_t *b, size_t size, size_t align)
+{
+	int order = size_to_order(b, size);
+	if (order < 0 || align < 1 || (align & (align - 1)) != 0 ||
+	    __builtin_ctzl(align) > b->align_order)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		return NULL;
+	}
+	if (__builtin_ctzl(align) > order)
+	{
+		order = __builtin_ctzl(align);
+	}
+	return buddy_alloc_block(b, order, size);
+}
+
+/**
+ * Allocate a memory block from the default arena.
+ *
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_alloc(size_t size)
+{
+	return buddy_arena_alloc(g_buddy, size);
+}
+
+/**
+ * Allocate an aligned memory block from the default arena.
+ *
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two up to the arena size
+ * @return memory block address
+ */
+void *buddy_alloc_aligned(size_t size, size_t align)
+{
+	return buddy_arena_alloc_aligned(g_buddy, size, align);
+}
+
+/**
+ * Converts order to number of bytes, basically 2 to the nth power
+ * @param order order of memory size
+ * @return memory size in bytes
+ */
+size_t order_to_bytes(int order)
+{
+	return (size_t)1 << order;
+}
+
+#if USE_LOCKFREE
+/**
+ * Free an allocated memory block.
+ *
+ * Merging claims the free buddy with a CAS on its node, so two threads can
+ * never take the same buddy. When both buddies are freed at the same time
+ * each may see the other still in use; after publishing its block a thread
+ * therefore looks once more, and both sides claim the lower half first so at
+ * most one of them goes on to merge.
+ *
+ * @param b arena
+ * @param addr memory block address to be freed
+ */
+static void buddy_free_block(buddy_t *b, void *addr)
+{
+	long index = ADDR_TO_PAGE(b, addr);
+	int order = PAGES(b)[index].order;
+
+	while (order < b->max_order)
+	{
+		long buddy = index ^ (1L << (order - b->min_order));
+
+		if ((unsigned long)buddy < b->nr_pages && free_block_claim(b, order, buddy))
+		{
+			index &= buddy;
+			order++;
+			STAT_ADD(b, merges[order], 1);
+			continue;
+		}
+
+		buddy_release(b, index, order);
+		free_block_add(b, &PAGES(b)[index], order);
+
+		if ((unsigned long)buddy >= b->nr_pages ||
+		    !NODE_IS_FREE(b, atomic_load(&NODES(b)[NODE_OF(b, order, buddy)].state)))
+		{
+			return;
+		}
+		long low = index & buddy;
+		long high = index | buddy;
+		if (!free_block_claim(b, order, low))
+		{
+			return;
+		}
+		if (!free_block_claim(b, order, high))
+		{
+			free_block_add(b, &PAGES(b)[low], order);
+			return;
+		}
+		index = low;
+		order++;
+		STAT_ADD(b, merges[order], 1);
+	}
+	buddy_release(b, index, order);
+	free_block_add(b, &PAGES(b)[index], order);
+}
+#else
+/**
+ * Finds the free buddy of a block
+ *
+ * The buddy is free exactly when its head page is marked free with the same
+ * order, so this is a single descriptor lookup instead of a free list walk.
+ *
+ * @param b arena
+ * @param size order of the block
+ * @param addr address of the block
+ * @return head page of the free buddy, or NULL if the buddy is in use
+ */
+static page_t* whereisavialable(buddy_t *b, int size, void* addr)
+{
+	/* a block of the largest order has no buddy */
+	if (size >= b->max_order)
+	{
+		return NULL;
+	}
+	unsigned long index = ADDR_TO_PAGE(b, BUDDY_ADDR(b, addr, size));
+	/* the buddy can fall past the end of an arena that is not a power of two */
+	if (index >= b->nr_pages)
+	{
+		return NULL;
+	}
+	page_t * page = &PAGES(b)[index];
+	/* the buddy may be free but split into smaller blocks, which does not count */
+	if (page->state == PAGE_FREE && page->order == size)
+	{
+		return page;
+	}
+	return NULL;
+}
+
+/**
+ * Merge a block with its free buddies and put it on a free list.
+ *
+ * Whenever a block is freed, the allocator checks its buddy. If the buddy is
+ * free as well, then the two buddies are combined to form a bigger block. This
+ * process continues until one of the buddies is not free.
+ *
+ * The caller holds the arena lock.
+ *
+ * @param b arena
+ * @param addr memory block address to be freed
+ */
+static void buddy_merge_block(buddy_t *b, void *addr)
+{
+	/* Initialize variable to iterate and keep track of location */
+	/* Create a variable to house buddy's address */
+	unsigned long buddy_address = ADDR_TO_PAGE(b, addr);
+	/* Create a variable to house the block size , which will be incremented */
+	int buddy_block_size = PAGES(b)[buddy_address].order;
+	/* Create a page_t variable to house the location of whether buddy has a similiar size address */
+	page_t * current_page;
+
+
+	/* loop through the possible values that the block size could be */
+	while(buddy_block_size <= b->max_order)
+	{
+		/* get the location of a same sized list item */
+		current_page = whereisavialable(b, buddy_block_size, addr);
+
+		/* if there is no same sized location */
+		if ( current_page == NULL )
+		{
+			buddy_release(b, buddy_address, buddy_block_size);
+			free_block_add(b, &PAGES(b)[buddy_address], buddy_block_size);
+			return;
+		}
+		// an entry was found that is the same size as buddy
+		else
+		{
+			#if USE_DEBUG
+				printf("%s%p\n","addr:",addr );
+			#endif
+			#if USE_DEBUG
+				printf("%s%p\n","current_page address:",PAGE_TO_ADDR(b, PAGE_INDEX(b, current_page)) );
+			#endif
+			/* increment the address */
+			if( (char*) addr > (char*) PAGE_TO_ADDR(b, PAGE_INDEX(b, current_page)) )
+			{
+				buddy_address = PAGE_INDEX(b, current_page);
+				addr = PAGE_TO_ADDR(b, buddy_address);
+			}
+			/* Delete the current list entry */
+			free_block_del(b, current_page);
+			/* check the next size up of the block sizes */
+			buddy_block_size = buddy_block_size + 1;
+			STAT_ADD(b, merges[buddy_block_size], 1);
+		}
+	}
+}
+
+/**
+ * Free an allocated memory block.
+ *
+ * In lazy mode the block is put on its free list as it is, without looking
+ * at its buddy, as long as its order holds fewer than lazy_watermark such
+ * blocks. The next allocation of that order takes it back without a split.
+ * Otherwise it is merged right away.
+ *
+ * The caller holds the arena lock.
+ *
+ * @param b arena
+ * @param addr memory block address to be freed
+ */
+static void buddy_free_block(buddy_t *b, void *addr)
+{
+	page_t *page = &PAGES(b)[ADDR_TO_PAGE(b, addr)];
+	int order = page->order;
+
+	if (b->lazy_count[order] < (uint32_t)b->lazy_watermark)
+	{
+		free_block_add(b, page, order);
+		page->state = PAGE_LAZY;
+		b->lazy_count[order]++;
+		b->lazy_blocks++;
+		return;
+	}
+	buddy_merge_block(b, addr);
+}
+
+/**
+ * Merge every lazily freed block with its buddies
+ *
+ * The lazy blocks are taken off their lists first and merged afterwards, so
+ * merging never removes a block from a list that is being walked.
+ * The caller holds the arena lock.
+ *
+ * @param b arena
+ * @return 1 if there was anything to merge
+ */
+static int buddy_coalesce_lazy(buddy_t *b)
+{
+	uint32_t pending = PAGE_NONE;
+
+	if (b->lazy_blocks == 0)
+	{
+		return 0;
+	}
+	for (int o = b->min_order; o <= b->max_order; o++)
+	{
+		uint32_t i = b->free_area[o];
+		while (b->lazy_count[o] > 0 && i != PAGE_NONE)
+		{
+			page_t *page = &PAGES(b)[i];
+			uint32_t next = page->next;
+
+			if (page->state == PAGE_LAZY)
+			{
+				free_block_del(b, page);
+				page->next = pending;
+				pending = i;
+			}
+			i = next;
+		}
+	}
+	while (pending != PAGE_NONE)
+	{
+		uint32_t i = pending;
+		pending = PAGES(b)[i].next;
+		buddy_merge_block(b, PAGE_TO_ADDR(b, i));
+	}
+	return 1;
+}
+#endif
+
+/**
+ * Free every piece of an allocated block, one piece only unless it was
+ * trimmed. The caller holds the arena lock.
+ * @param b arena
+ * @param index head page of the block, its live mark already taken off
+ */
+static void buddy_free_pieces(buddy_t *b, long index)
+{
+	for (;;)
+	{
+		page_t *page = &PAGES(b)[index];
+		int more = page->state == PAGE_TRIMMED;
+		long next = index + (1L << (page->order - b->min_order));
+
+		/* the next piece is still allocated, so no merge reaches it */
+		page->state = 0;
+		buddy_free_block(b, PAGE_TO_ADDR(b, index));
+		if (!more)
+		{
+			return;
+		}
+		index = next;
+	}
+}
+
+/**
+ * Free an allocated memory block of an arena.
+ *
+ * An address that is not a block handed out and not freed yet is turned
+ * away in O(1) and counted in invalid_frees; the hardened build aborts.
+ *
+ * @param b arena
+ * @param addr memory block address to be freed, may be NULL
+ * @return 0, or -1 if addr is not a live block of the arena
+ */
+int buddy_arena_free(buddy_t *b, void *addr)
+{
+	if (addr == NULL)
+	{
+		return 0;
+	}
+	long index = claim_live(b, addr);
+	if (index < 0)
+	{
+		return -1;
+	}
+
+	stats_free(b, &PAGES(b)[index]);
+#if USE_MAGAZINES
+	int order = PAGES(b)[index].order;
+	if (order < b->min_order + CACHE_ORDERS && !b->shared && PAGES(b)[index].state != PAGE_TRIMMED)
+	{
+		magazine_free(b, addr, order);
+		return 0;
+	}
+#endif
+
+	BUDDY_LOCK(b);
+	buddy_free_pieces(b, index);
+	BUDDY_UNLOCK(b);
+	return 0;
+}
+
+/**
+ * Free a memory block of the default arena.
+ *
+ * @param addr memory block address to be freed, may be NULL
+ * @return 0, or -1 if addr is not a live block
+ */
+int buddy_free(void *addr)
+{
+	return buddy_arena_free(g_buddy, addr);
+}
+
+/**
+ * Switch an arena between eager and lazy coalescing
+ *
+ * In lazy mode up to watermark freed blocks per order stay on their free
+ * list unmerged, so alloc/free cycles of the same size reuse them without a
+ * split and a merge each time. They are merged once an allocation finds no
+ * block large enough, or when the watermark is lowered.
+ *
+ * @param b arena
+ * @param watermark most unmerged free blocks per order, 0 to merge eagerly
+ * @return 0, or -1 if the build does not support lazy coalescing
+ */
+int buddy_arena_set_lazy(buddy_t *b, int watermark)
+{
+#if USE_LOCKFREE
+	(void)b;
+	(void)watermark;
+	return -1;
+#else
+	BUDDY_LOCK(b);
+	if (watermark < b->lazy_watermark)
+	{
+		buddy_coalesce_lazy(b);
+	}
+	b->lazy_watermark = watermark > 0 ? watermark : 0;
+	BUDDY_UNLOCK(b);
+	return 0;
+#endif
+}
+
+/**
+ * Switch the default arena between eager and lazy coalescing
+ *
+ * @param watermark most unmerged free blocks per order, 0 to merge eagerly
+ * @return 0, or -1 if the build does not support lazy coalescing
+ */
+int buddy_set_lazy(int watermark)
+{
+	return buddy_arena_set_lazy(g_buddy, watermark);
+}
+
+/**
+ * Switch an arena between whole and trimmed blocks
+ *
+ * A trimmed block still comes out of a power of two block, but only the
+ * pages the request covers are kept, as up to one aligned piece per order;
+ * the tail goes straight back to the free lists as smaller blocks. An 80K
+ * request with 4K pages takes 64K + 16K and leaves 16K + 32K free instead
+ * of holding 128K. Freeing the block frees every piece, and they merge with
+ * the tail again as far as it is still free. Trimmed blocks bypass the
+ * per-CPU magazines, and are moved rather than resized in place by
+ * buddy_arena_realloc(). Blocks allocated before the switch keep their size.
+ *
+ * @param b arena
+ * @param on 1 to trim, 0 for whole blocks
+ * @return 0
+ */
+int buddy_arena_set_trim(buddy_t *b, int on)
+{
+	BUDDY_LOCK(b);
+	b->trim = on != 0;
+	BUDDY_UNLOCK(b);
+	return 0;
+}
+
+/**
+ * Switch the default arena between whole and trimmed blocks
+ *
+ * @param on 1 to trim, 0 for whole blocks
+ * @return 0
+ */
+int buddy_set_trim(int on)
+{
+	return buddy_arena_set_trim(g_buddy, on);
+}
+
+#if USE_LOCKFREE
+/**
+ * Resize an allocated block in place
+ *
+ * Growing claims the higher buddy at every order on the way up; if one of
+ * them is not free the ones already claimed are given back. Shrinking gives
+ * the upper halves back. The order in the page descriptor is left to the
+ * caller.
+ *
+ * @param b arena
+ * @param index head page of the block
+ * @param new_order order the block should have
+ * @return 1 if the block now spans new_order, 0 if it cannot grow in place
+ */
+static int buddy_resize_block(buddy_t *b, long index, int new_order)
+{
+	int order = PAGES(b)[index].order;
+
+	/* only a block that is the lower half at every order can grow */
+	if (new_order > order && (index & ((1L << (new_order - b->min_order)) - 1)) != 0)
+	{
+		return 0;
+	}
+	for (int o = order; o < new_order; o++)
+	{
+		long buddy = index + (1L << (o - b->min_order));
+
+		if ((unsigned long)buddy >= b->nr_pages || !free_block_claim(b, o, buddy))
+		{
+			while (--o >= order)
+			{
+				free_block_add(b, &PAGES(b)[index + (1L << (o - b->min_order))], o);
+			}
+			return 0;
+		}
+	}
+	for (int o = order; o < new_order; o++)
+	{
+		STAT_ADD(b, merges[o + 1], 1);
+	}
+
+	for (int o = order - 1; o >= new_order; o--)
+	{
+		buddy_release(b, index + (1L << (o - b->min_order)), o);
+		buddy_split(b, o, index);
+	}
+	return 1;
+}
+#else
+/**
+ * Resize an allocated block in place
+ *
+ * Growing absorbs the higher buddy at every order on the way up, which needs
+ * all of them to be free as whole blocks. Shrinking gives the upper halves
+ * back through buddy_split(). The order in the page descriptor is left to the
+ * caller, who holds the arena lock.
+ *
+ * @param b arena
+ * @param index head page of the block
+ * @param new_order order the block should have
+ * @return 1 if the block now spans new_order, 0 if it cannot grow in place
+ */
+static int buddy_resize_block(buddy_t *b, long index, int new_order)
+{
+	void *addr = PAGE_TO_ADDR(b, index);
+	int order = PAGES(b)[index].order;
+
+	/* only a block that is the lower half at every order can grow */
+	if (new_order > order && (index & ((1L << (new_order - b->min_order)) - 1)) != 0)
+	{
+		return 0;
+	}
+	for (int o = order; o < new_order; o++)
+	{
+		if (whereisavialable(b, o, addr) == NULL)
+		{
+			return 0;
+		}
+	}
+	for (int o = order; o < new_order; o++)
+	{
+		free_block_del(b, whereisavialable(b, o, addr));
+		STAT_ADD(b, merges[o + 1], 1);
+	}
+
+	for (int o = order - 1; o >= new_order; o--)
+	{
+		buddy_release(b, index + (1L << (o - b->min_order)), o);
+		buddy_split(b, o, index);
+	}
+	return 1;
+}
+#endif
+
+/**
+ * Change the size of an allocated block
+ *
+ * The block is resized in place when it shrinks, or when it grows and the
+ * buddies it needs are free; in trim mode the new block is trimmed as well.
+ * Otherwise, and always for a trimmed block, a new block is allocated, the
+ * data is copied over and the old block freed. A NULL addr allocates, a
+ * size of 0 frees. An addr that is not a live block is an invalid free.
+ *
+ * @param b arena
+ * @param addr memory block address, or NULL
+ * @param size new size in bytes
+ * @return address of the resized block, or NULL if no block of that size is
+ * available, in which case the old block is left as it was
+ */
+void *buddy_arena_realloc(buddy_t *b, void *addr, size_t size)
+{
+	if (addr == NULL)
+	{
+		return buddy_arena_alloc(b, size);
+	}
+	if (size == 0)
+	{
+		buddy_arena_free(b, addr);
+		return NULL;
+	}
+
+	long index = addr_to_page_checked(b, addr);
+	if (index < 0 || PAGES(b)[index].live != b->epoch)
+	{
+		invalid_free(b, addr);
+		return NULL;
+	}
+	int order = size_to_order(b, size);
+	if (order < 0)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		return NULL;
+	}
+
+	page_t *page = &PAGES(b)[index];
+	size_t old_bytes = block_bytes(b, index);
+	unsigned long pages = pages_needed(b, order, size);
+
+	/* a trimmed block is moved whole */
+	BUDDY_LOCK(b);
+	int resized = page->state != PAGE_TRIMMED && buddy_resize_block(b, index, order);
+	if (resized)
+	{
+		stats_free(b, page);
+		page->order = order;
+		if (pages < (1UL << (order - b->min_order)))
+		{
+			buddy_trim_block(b, index, order, pages);
+		}
+	}
+	BUDDY_UNLOCK(b);
+
+	if (resized)
+	{
+		stats_alloc(b, &addr, 1, page->order, size);
+		return addr;
+	}
+
+	void *new_addr = buddy_arena_alloc(b, size);
+	if (new_addr == NULL)
+	{
+		return NULL;
+	}
+	/* a growing block, or a trimmed one of any size */
+	memcpy(new_addr, addr, old_bytes < size ? old_bytes : size);
+	buddy_arena_free(b, addr);
+	return new_addr;
+}
+
+/**
+ * Change the size of a block of the default arena
+ *
+ * @param addr memory block address, or NULL
+ * @param size new size in bytes
+ * @return address of the resized block, or NULL
+ */
+void *buddy_realloc(void *addr, size_t size)
+{
+	return buddy_arena_realloc(g_buddy, addr, size);
+}
+
+#if USE_LOCKFREE
+/**
+ * Allocate up to n blocks of one order. The stacks have no cheap way to take
+ * a whole split chain at once, so this is a loop of single allocations.
+ * @param b arena
+ * @param order order of the blocks
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated
+ */
+static int buddy_alloc_bulk_order(buddy_t *b, int order, int n, void **out)
+{
+	int got = 0;
+
+	while (got < n && (out[got] = buddy_alloc_order(b, order)) != NULL)
+	{
+		got++;
+	}
+	return got;
+}
+#else
+/**
+ * Allocate up to n blocks of one order. Blocks already free at that order are
+ * taken first. After that each larger block is carved into as many blocks as
+ * are still needed in one pass, and only its unused tail goes back to the
+ * free lists, as the largest aligned blocks that fit.
+ * The caller holds the arena lock.
+ * @param b arena
+ * @param order order of the blocks
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated
+ */
+static int buddy_alloc_bulk_order(buddy_t *b, int order, int n, void **out)
+{
+	int got = 0;
+
+	while (got < n)
+	{
+		unsigned long usable = b->free_area_mask & ~((1UL << order) - 1);
+		if (usable == 0 && buddy_coalesce_lazy(b))
+		{
+			usable = b->free_area_mask & ~((1UL << order) - 1);
+		}
+		if (usable == 0)
+		{
+			break;
+		}
+		int block_order = __builtin_ctzl(usable);
+		uint32_t index = b->free_area[block_order];
+		free_block_del(b, &PAGES(b)[index]);
+
+		/* hand out the first pieces of the block */
+		unsigned long span = 1UL << (order - b->min_order);
+		unsigned long pieces = 1UL << (block_order - order);
+		unsigned long used = pieces < (unsigned long)(n - got) ? pieces : (unsigned long)(n - got);
+		for (unsigned long i = 0; i < used; i++)
+		{
+			/* only the head of the carved block was written this epoch,
+			 * a stale free mark on another piece would let its buddy merge */
+			PAGES(b)[index + i * span].order = order;
+			PAGES(b)[index + i * span].state = 0;
+			out[got++] = PAGE_TO_ADDR(b, index + i * span);
+		}
+#if USE_STATS
+		/* every block of the carved one that overlaps a piece was split */
+		for (int o = order + 1; o <= block_order; o++)
+		{
+			STAT_ADD(b, splits[o], ((used << order) + (1UL << o) - 1) >> o);
+		}
+#endif
+
+		/* and give the rest back, largest aligned blocks first */
+		unsigned long offset = used * span;
+		unsigned long end = pieces * span;
+		while (offset < end)
+		{
+			int o = order + __builtin_ctzl(offset >> (order - b->min_order));
+			while (offset + (1UL << (o - b->min_order)) > end)
+			{
+				o--;
+			}
+			free_block_add(b, &PAGES(b)[index + offset], o);
+			offset += 1UL << (o - b->min_order);
+		}
+	}
+	return got;
+}
+#endif
+
+/**
+ * Allocate a burst of blocks of the same size
+ *
+ * Takes the arena lock once for the whole burst and bypasses the per-CPU
+ * magazines.
+ *
+ * @param b arena
+ * @param size size in bytes of every block
+ * @param n number of blocks wanted
+ * @param out receives the block addresses, in ascending order within each
+ * carved block
+ * @return number of blocks allocated, less than n if the arena ran out
+ */
+int buddy_arena_alloc_bulk(buddy_t *b, size_t size, int n, void **out)
+{
+	int order = size_to_order(b, size);
+	if (n < 1)
+	{
+		return 0;
+	}
+	if (order < 0)
+	{
+		STAT_ADD(b, failed_allocs, n);
+		return 0;
+	}
+	if (pages_needed(b, order, size) < (1UL << (order - b->min_order)))
+	{
+		/* trimmed blocks are not carved out together */
+		int got = 0;
+		while (got < n && (out[got] = buddy_alloc_block(b, order, size)) != NULL)
+		{
+			got++;
+		}
+		/* the call that failed has been counted already */
+		if (got < n)
+		{
+			STAT_ADD(b, failed_allocs, n - got - 1);
+		}
+		return got;
+	}
+
+	BUDDY_LOCK(b);
+	int got = buddy_alloc_bulk_order(b, order, n, out);
+	BUDDY_UNLOCK(b);
+
+	mark_live(b, out, got);
+	stats_alloc(b, out, got, order, size);
+	STAT_ADD(b, failed_allocs, n - got);
+	return got;
+}
+
+/**
+ * Allocate a burst of blocks of the same size from the default arena.
+ *
+ * @param size size in bytes of every block
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated
+ */
+int buddy_alloc_bulk(size_t size, int n, void **out)
+{
+	return buddy_arena_alloc_bulk(g_buddy, size, n, out);
+}
+
+/**
+ * Free a burst of blocks
+ *
+ * Every block is first marked pending in its page structure. Blocks whose
+ * buddy is also pending at the same order are then merged right away, so
+ * a burst carved from one block collapses again without touching the free
+ * lists. Only the merged blocks go through the regular free path. Addresses
+ * that are not live blocks are counted as invalid frees and skipped.
+ *
+ * @param b arena
+ * @param addrs memory block addresses to be freed
+ * @param n number of addresses
+ */
+void buddy_arena_free_bulk(buddy_t *b, void **addrs, int n)
+{
+#if USE_LOCKFREE
+	/* the pending marks are not atomic, other threads may be merging */
+	for (int i = 0; i < n; i++)
+	{
+		long index = claim_live(b, addrs[i]);
+		if (index >= 0)
+		{
+			stats_free(b, &PAGES(b)[index]);
+			buddy_free_pieces(b, index);
+		}
+	}
+#else
+	BUDDY_LOCK(b);
+	for (int i = 0; i < n; i++)
+	{
+		long index = claim_live(b, addrs[i]);
+		if (index >= 0)
+		{
+			stats_free(b, &PAGES(b)[index]);
+			if (PAGES(b)[index].state == PAGE_TRIMMED)
+			{
+				buddy_free_pieces(b, index);
+				continue;
+			}
+			PAGES(b)[index].state = PAGE_PENDING;
+		}
+	}
+	for (int i = 0; i < n; i++)
+	{
+		long index = addr_to_page_checked(b, addrs[i]);
+		int order;
+
+		/* invalid, or already merged into a pending buddy */
+		if (index < 0 || PAGES(b)[index].state != PAGE_PENDING)
+		{
+			continue;
+		}
+		order = PAGES(b)[index].order;
+		while (order < b->max_order)
+		{
+			long buddy = index ^ (1L << (order - b->min_order));
+			if ((unsigned long)buddy >= b->nr_pages || PAGES(b)[buddy].state != PAGE_PENDING ||
+			    PAGES(b)[buddy].order != order)
+			{
+				break;
+			}
+			PAGES(b)[index].state = 0;
+			PAGES(b)[buddy].state = 0;
+			index &= buddy;
+			order++;
+			PAGES(b)[index].order = order;
+			PAGES(b)[index].state = PAGE_PENDING;
+			STAT_ADD(b, merges[order], 1);
+		}
+	}
+	/* each merged block is headed by the page of one of the original blocks */
+	for (int i = 0; i < n; i++)
+	{
+		long index = addr_to_page_checked(b, addrs[i]);
+		if (index >= 0 && PAGES(b)[index].state == PAGE_PENDING)
+		{
+			PAGES(b)[index].state = 0;
+			buddy_free_block(b, PAGE_TO_ADDR(b, index));
+		}
+	}
+	BUDDY_UNLOCK(b);
+#endif
+}
+
+/**
+ * Free a burst of blocks of the default arena.
+ *
+ * @param addrs memory block addresses to be freed
+ * @param n number of addresses
+ */
+void buddy_free_bulk(void **addrs, int n)
+{
+	buddy_arena_free_bulk(g_buddy, addrs, n);
+}
+
+/**
+ * Write a number in decimal
+ *
+ * @param p where to write
+ * @param v the number
+ * @return end of the digits
+ */
+static char *format_ulong(char *p, unsigned long v)
+{
+	char digits[24];
+	int n = 0;
+
+	do
+	{
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (n > 0)
+	{
+		*p++ = digits[--n];
+	}
+	return p;
+}
+
+/**
+ * Print the buddy system status---order oriented
+ *
+ * print free pages in each order, read from the free block counters. The
+ * line is formatted by hand and written in one go, as the simulator dumps
+ * after every command.
+ *
+ * @param b arena
+ */
+void buddy_arena_dump(buddy_t *b)
+{
+	/* count, size and unit of every order */
+	char line[NR_ORDERS * 40];
+	char *p = line;
+	int o;
+
+#if USE_MAGAZINES
+	/* blocks parked in the magazines are free too */
+	magazine_drain(b);
+#endif
+	BUDDY_LOCK(b);
+	for (o = b->min_order; o <= b->max_order; o++) {
+		unsigned long cnt = free_block_count(b, o);
+		p = format_ulong(p, cnt);
+		*p++ = ':';
+		if (o >= 10) {
+			p = format_ulong(p, (1UL<<o)/1024);
+			*p++ = 'K';
+		} else {
+			p = format_ulong(p, 1UL<<o);
+			*p++ = 'B';
+		}
+		*p++ = ' ';
+	}
+	*p++ = '\n';
+	fwrite(line, 1, p - line, stdout);
+	BUDDY_UNLOCK(b);
+}
+
+/**
+ * Print the status of the default arena
+ */
+void buddy_dump()
+{
+	buddy_arena_dump(g_buddy);
+}
+
+/**
+ * Copy the statistics of an arena
+ *
+ * Takes no lock and walks no list, so it is cheap enough to poll on a live
+ * arena; counters updated by other threads meanwhile may be slightly out of
+ * step with each other. Blocks parked in the per-CPU magazines count as
+ * allocated in free_blocks but not in bytes_allocated.
+ *
+ * @param b arena
+ * @param st receives the statistics
+ */
+void buddy_arena_stats(buddy_t *b, buddy_stats_t *st)
+{
+	if (CONCURRENT(b))
+	{
+		unsigned long *from = (unsigned long *)&b->stats;
+		unsigned long *to = (unsigned long *)st;
+
+		/* the struct is nothing but word sized counters */
+		for (size_t i = 0; i < sizeof(*st) / sizeof(unsigned long); i++)
+		{
+			to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+		}
+	}
+	else
+	{
+		*st = b->stats;
+	}
+}
+
+/**
+ * Copy the statistics of the default arena
+ *
+ * @param st receives the statistics
+ */
+void buddy_stats(buddy_stats_t *st)
+{
+	buddy_arena_stats(g_buddy, st);
+}
+
+/**
+ * Order of the largest free block of an arena, the largest request it can
+ * serve right now. Blocks parked in the per-CPU magazines are not counted.
+ *
+ * @param b arena
+ * @return order of the largest free block, or -1 if nothing is free
+ */
+int buddy_arena_largest_free_order(buddy_t *b)
+{
+#if USE_LOCKFREE
+	for (int o = b->max_order; o >= b->min_order; o--)
+	{
+		if (free_block_count(b, o) > 0)
+		{
+			return o;
+		}
+	}
+	return -1;
+#else
+	BUDDY_LOCK(b);
+	unsigned long mask = b->free_area_mask;
+	BUDDY_UNLOCK(b);
+
+	return mask ? (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(mask) : -1;
+#endif
+}
+
+/**
+ * Order of the largest free block of the default arena
+ *
+ * @return order of the largest free block, or -1 if nothing is free
+ */
+int buddy_largest_free_order()
+{
+	return buddy_arena_largest_free_order(g_buddy);
+}
+
+/**
+ * External fragmentation index of an arena for requests of an order
+ *
+ * The share of the free memory that sits in blocks too small to serve a
+ * request of that order. 0 means every free byte could serve it; close to 1
+ * means there is free memory, but only in small pieces.
+ *
+ * @param b arena
+ * @param order order of the request
+ * @return index between 0 and 1, 0 if nothing is free
+ */
+double buddy_arena_fragmentation(buddy_t *b, int order)
+{
+	double total = 0;
+	double unusable = 0;
+
+	for (int o = b->min_order; o <= b->max_order; o++)
+	{
+		double bytes = (double)free_block_count(b, o) * (1UL << o);
+		total += bytes;
+		if (o < order)
+		{
+			unusable += bytes;
+		}
+	}
+	return total > 0 ? unusable / total : 0;
+}
+
+/**
+ * External fragmentation index of the default arena for requests of an order
+ *
+ * @param order order of the request
+ * @return index between 0 and 1, 0 if nothing is free
+ */
+double buddy_fragmentation(int order)
+{
+	return buddy_arena_fragmentation(g_buddy, order);
+}
+
+/**
+ * Mark the pages of a free block as covered
+ * @param b arena
+ * @param covered one flag per page
+ * @param index head page of the block
+ * @param order order of the block
+ * @return 1 if the block is aligned, inside the arena and overlaps nothing seen so far
+ */
+static int check_block(buddy_t *b, char *covered, long index, int order)
+{
+	long span = 1L << (order - b->min_order);
+
+	if (index < 0 || (index & (span - 1)) != 0 || (unsigned long)(index + span) > b->nr_pages)
+	{
+		return 0;
+	}
+	for (long i = index; i < index + span; i++)
+	{
+		if (covered[i])
+		{
+			return 0;
+		}
+		covered[i] = 1;
+	}
+	return 1;
+}
+
+/**
+ * Check the free block invariants of an arena
+ *
+ * Every free block must be naturally aligned, lie inside the arena, be marked
+ * free at its order and overlap no other free block, and the free block
+ * counters must match the lists. Only meaningful while no thread is inside
+ * the arena.
+ *
+ * @param b arena
+ * @return number of free bytes, or -1 if an invariant is broken
+ */
+long buddy_arena_check(buddy_t *b)
+{
+	char *covered = calloc(b->nr_pages, 1);
+	long free_bytes = 0;
+	int ok = covered != NULL;
+
+#if USE_MAGAZINES
+	magazine_drain(b);
+#endif
+	BUDDY_LOCK(b);
+	for (int o = b->min_order; ok && o <= b->max_order; o++)
+	{
+#if USE_LOCKFREE
+		unsigned long end = o < b->max_order ? b->node_base[o + 1] : b->node_base[o] +
+			(((unsigned long)b->nr_pages + (1UL << (o - b->min_order)) - 1) >> (o - b->min_order));
+		unsigned long linked = 0;
+		unsigned long steps = 0;
+
+		/* every free node must be on the stack, and the stack must end */
+		for (uint32_t top = (uint32_t)atomic_load(&b->free_stack[o]); ok && top != 0;
+		     top = atomic_load(&NODES(b)[top - 1].next))
+		{
+			uint32_t node = top - 1;
+			uint32_t state = atomic_load(&NODES(b)[node].state);
+
+			ok = node >= b->node_base[o] && node < end &&
+			     (state & ~(uint32_t)NODE_FREE) == (NODE_EPOCH(b) | NODE_LINKED) &&
+			     ++steps <= end - b->node_base[o];
+			if (ok && NODE_IS_FREE(b, state))
+			{
+				ok = check_block(b, covered, (node - b->node_base[o]) << (o - b->min_order), o);
+				free_bytes += 1L << o;
+				linked++;
+			}
+		}
+		ok = ok && linked == free_block_count(b, o);
+		for (unsigned long node = b->node_base[o]; ok && node < end; node++)
+		{
+			if (NODE_IS_FREE(b, atomic_load(&NODES(b)[node].state)))
+			{
+				linked--;
+			}
+		}
+		ok = ok && linked == 0;
+#else
+		unsigned long cnt = 0;
+		unsigned long lazy = 0;
+
+		ok = (b->free_area[o] == PAGE_NONE) == !(b->free_area_mask & (1UL << o));
+		for (uint32_t i = b->free_area[o]; i != PAGE_NONE; i = PAGES(b)[i].next)
+		{
+			page_t *page = &PAGES(b)[i];
+
+			ok = ok && (page->state == PAGE_FREE || page->state == PAGE_LAZY) &&
+			     page->order == o && page->live != b->epoch && check_block(b, covered, i, o);
+			if (!ok)
+			{
+				break;
+			}
+			free_bytes += 1L << o;
+			cnt++;
+			lazy += page->state == PAGE_LAZY;
+		}
+		ok = ok && cnt == free_block_count(b, o) && lazy == b->lazy_count[o];
+#endif
+	}
+	BUDDY_UNLOCK(b);
+
+	free(covered);
+	return ok ? free_bytes : -1;
+}
+
+/**
+ * Write a whole buffer at an offset of a file
+ * @param fd file
+ * @param buf data
+ * @param len bytes to write
+ * @param off file offset
+ * @return 0, or -1 with errno set
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/**
+ * Write an arena to a file for buddy_arena_restore()
+ *
+ * The file gets the layout of a shared arena: the header, the page
+ * structures and the memory, found by offset from the header and free of
+ * pointers, so it can be mapped back anywhere as it is. Anything the file
+ * held before is replaced. The arena is locked while it is written, but
+ * blocks that other threads are filling meanwhile are copied as they are;
+ * take the snapshot while the arena is quiet.
+ *
+ * @param b arena
+ * @param fd regular file open for writing
+ * @return 0, or -1 with errno set
+ */
+int buddy_arena_snapshot(buddy_t *b, int fd)
+{
+	size_t meta_size = arena_meta_size(b->nr_pages, b->min_order, b->max_order);
+	size_t meta_off, memory_off;
+	size_t image_len = arena_image_layout(b->nr_pages, b->min_order, meta_size, &meta_off, &memory_off);
+
+	buddy_t *hdr = malloc(sizeof(*hdr));
+	if (hdr == NULL)
+	{
+		return -1;
+	}
+
+#if USE_MAGAZINES
+	/* blocks parked in the magazines would come back allocated */
+	magazine_drain(b);
+#endif
+	BUDDY_LOCK(b);
+	/* the lock and the magazines are copied too, restore sets them up anew */
+	memcpy(hdr, b, sizeof(*hdr));
+	hdr->magic = SNAPSHOT_MAGIC;
+	hdr->memory_off = memory_off;
+	hdr->pages_off = meta_off;
+#if USE_LOCKFREE
+	hdr->nodes_off = meta_off + b->nr_pages * sizeof(page_t);
+#endif
+	hdr->map_len = 0;
+	hdr->image_len = image_len;
+	hdr->shared = 0;
+
+	int ret = ftruncate(fd, 0) == 0 && ftruncate(fd, image_len) == 0 &&
+		  pwrite_all(fd, hdr, sizeof(*hdr), 0) == 0 &&
+		  pwrite_all(fd, PAGES(b), meta_size, meta_off) == 0 &&
+		  pwrite_all(fd, MEMORY(b), b->size, memory_off) == 0 ? 0 : -1;
+	BUDDY_UNLOCK(b);
+
+	free(hdr);
+	return ret;
+}
+
+/**
+ * Map an arena written by buddy_arena_snapshot() back in
+ *
+ * The file is mapped copy-on-write and used as it is, with no pass over the
+ * blocks: pages of the arena are read in as they are first touched, and the
+ * file itself is never changed. The memory is placed as strictly aligned as
+ * in the arena that was written. Blocks keep their offsets, see
+ * buddy_offset(). The snapshot must come from the same build of the
+ * allocator. buddy_destroy() unmaps the arena.
+ *
+ * @param fd snapshot file open for reading
+ * @return the arena, or NULL if the file does not hold a snapshot or cannot
+ * be mapped, with errno set
+ */
+buddy_t *buddy_arena_restore(int fd)
+{
+	buddy_t *hdr = malloc(sizeof(*hdr));
+	if (hdr == NULL)
+	{
+		return NULL;
+	}
+
+	/* the header must describe exactly the image this build would write */
+	struct stat st;
+	unsigned long nr_pages;
+	int max_order;
+	size_t meta_off, memory_off, image_len = 0;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*hdr) &&
+	    pread(fd, hdr, sizeof(*hdr), 0) == (ssize_t)sizeof(*hdr) &&
+	    hdr->magic == SNAPSHOT_MAGIC &&
+	    arena_geometry(hdr->size, hdr->min_order, &nr_pages, &max_order) == 0 &&
+	    nr_pages == hdr->nr_pages && max_order == hdr->max_order &&
+	    hdr->align_order >= 0 && hdr->align_order <= max_order)
+	{
+		size_t meta_size = arena_meta_size(nr_pages, hdr->min_order, max_order);
+		image_len = arena_image_layout(nr_pages, hdr->min_order, meta_size, &meta_off, &memory_off);
+	}
+	if (image_len == 0 || image_len != (size_t)st.st_size || hdr->image_len != image_len ||
+	    hdr->pages_off != meta_off || hdr->memory_off != memory_off)
+	{
+		free(hdr);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* reserve room to align the memory, then map the file over it */
+	size_t align = 1UL << hdr->align_order;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	if (align < page_size)
+	{
+		align = page_size;
+	}
+	free(hdr);
+	char *map = mmap(NULL, image_len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+	char *base = (char *)((((uintptr_t)map + memory_off + align - 1) & ~(align - 1)) - memory_off);
+	if (mmap(base, image_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		int err = errno;
+		munmap(map, image_len + align);
+		errno = err;
+		return NULL;
+	}
+	if (base > map)
+	{
+		munmap(map, base - map);
+	}
+	if (map + image_len + align > base + image_len)
+	{
+		munmap(base + image_len, map + image_len + align - (base + image_len));
+	}
+
+	buddy_t *b = (buddy_t *)base;
+	b->magic = 0;
+#if !USE_LOCKFREE
+	pthread_mutex_init(&b->lock, NULL);
+#endif
+#if USE_MAGAZINES
+	for (int i = 0; i < NR_CPU_CACHES; i++)
+	{
+		/* cached blocks are kept by address, which is not the same anymore */
+		pthread_mutex_init(&b->cpu_cache[i].lock, NULL);
+		memset(b->cpu_cache[i].count, 0, sizeof(b->cpu_cache[i].count));
+	}
+#endif
+	return b;
+}
+
+/**
+ * Write the default arena to a file, see buddy_arena_snapshot()
+ *
+ * @param fd regular file open for writing
+ * @return 0, or -1 with errno set
+ */
+int buddy_snapshot(int fd)
+{
+	return buddy_arena_snapshot(g_buddy, fd);
+}
+
+/**
+ * Replace the default arena with a snapshot, see buddy_arena_restore()
+ *
+ * The restored arena lives in the mapping of the file rather than in
+ * g_memory; buddy_init() goes back to a fresh arena over g_memory.
+ *
+ * @param fd snapshot file open for reading
+ * @return 0, or -1 with errno set and the default arena left alone
+ */
+int buddy_restore(int fd)
+{
+	buddy_t *b = buddy_arena_restore(fd);
+	if (b == NULL)
+	{
+		return -1;
 	}
-	printf("\n");
+	buddy_destroy(g_buddy);
+	g_buddy = b;
+	return 0;
 }
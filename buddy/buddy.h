@@ -1,11 +1,80 @@
 #ifndef BUDDY_H
 #define BUDDY_H
 
+#include <stddef.h>
+
+/**
+ * An independently sized buddy arena
+ */
+typedef struct buddy buddy_t;
+
+/* number of orders covered by the per-order statistics */
+#define BUDDY_NR_ORDERS 64
+
+/**
+ * Arena statistics, all arrays indexed by order. The free block and invalid
+ * free counts are always kept; the other counters are only kept when the
+ * allocator is built with USE_STATS and read as zero otherwise.
+ */
+typedef struct {
+	size_t bytes_allocated;        ///< bytes in blocks handed out and not freed yet
+	size_t peak_bytes_allocated;   ///< highest bytes_allocated so far
+	size_t bytes_requested;        ///< bytes asked for by the callers of those blocks
+	unsigned long failed_allocs;   ///< requests that could not be served
+	unsigned long invalid_frees;   ///< frees turned away as not a live block
+	unsigned long free_blocks[BUDDY_NR_ORDERS];  ///< blocks on the free lists
+	unsigned long allocs[BUDDY_NR_ORDERS];       ///< blocks handed out
+	unsigned long frees[BUDDY_NR_ORDERS];        ///< blocks given back
+	unsigned long splits[BUDDY_NR_ORDERS];       ///< free blocks split into two buddies
+	unsigned long merges[BUDDY_NR_ORDERS];       ///< blocks formed by merging two buddies
+} buddy_stats_t;
+
+/* flags of buddy_create_mapped() */
+#define BUDDY_MAP_HUGETLB 1   ///< back the arena with 2 MiB hugetlbfs pages
+#define BUDDY_MAP_THP     2   ///< ask for transparent huge pages
+
+buddy_t *buddy_create(void *mem, size_t len, int min_order);
+buddy_t *buddy_create_mapped(size_t len, int min_order, int release_order, int flags);
+buddy_t *buddy_create_shared(const char *name, size_t len, int min_order);
+buddy_t *buddy_open_shared(const char *name);
+buddy_t *buddy_arena_restore(int fd);
+void buddy_destroy(buddy_t *b);
+void buddy_arena_reset(buddy_t *b);
+void *buddy_arena_alloc(buddy_t *b, size_t size);
+void *buddy_arena_alloc_aligned(buddy_t *b, size_t size, size_t align);
+int buddy_arena_free(buddy_t *b, void *addr);
+int buddy_arena_set_lazy(buddy_t *b, int watermark);
+int buddy_arena_set_trim(buddy_t *b, int on);
+void *buddy_arena_realloc(buddy_t *b, void *addr, size_t size);
+int buddy_arena_alloc_bulk(buddy_t *b, size_t size, int n, void **out);
+void buddy_arena_free_bulk(buddy_t *b, void **addrs, int n);
+void buddy_arena_dump(buddy_t *b);
+void buddy_arena_stats(buddy_t *b, buddy_stats_t *st);
+int buddy_arena_largest_free_order(buddy_t *b);
+double buddy_arena_fragmentation(buddy_t *b, int order);
+long buddy_arena_check(buddy_t *b);
+size_t buddy_offset(buddy_t *b, void *addr);
+void *buddy_address(buddy_t *b, size_t offset);
+int buddy_arena_snapshot(buddy_t *b, int fd);
+
+/* default arena */
 void buddy_init();
-void *buddy_alloc(int size);
-void buddy_free(void *addr);
+void buddy_reset();
+void *buddy_alloc(size_t size);
+void *buddy_alloc_aligned(size_t size, size_t align);
+int buddy_free(void *addr);
+int buddy_set_lazy(int watermark);
+int buddy_set_trim(int on);
+void *buddy_realloc(void *addr, size_t size);
+int buddy_alloc_bulk(size_t size, int n, void **out);
+void buddy_free_bulk(void **addrs, int n);
 void buddy_dump();
-int order_to_bytes(int order);
-void split(int order, int index);
+void buddy_stats(buddy_stats_t *st);
+int buddy_largest_free_order();
+double buddy_fragmentation(int order);
+int buddy_snapshot(int fd);
+int buddy_restore(int fd);
+size_t order_to_bytes(int order);
+void split(int order, unsigned long index);
 
 #endif // BUDDY_H
@@ -0,0 +1,2027 @@
+/**
+ * Buddy Allocator, bitmap tree backend
+ *
+ * The whole buddy state is an implicit complete binary tree with one byte per
+ * node: the largest free order inside the node's block plus one, or 0 when
+ * nothing in it is free. Node 1 is the root, node n has children 2n and
+ * 2n+1. A node whose value equals its own order plus one is a free block;
+ * the values below it are stale until the block is split again.
+ *
+ * All metadata sits in one allocation right behind the arena header, so it
+ * contains no pointers into itself and can be copied with a single memcpy.
+ * The memory is found by its offset from the header as well, which lets an
+ * arena in shared memory work wherever a process maps it.
+ */
+
+
+/**************************************************************************
+ * Conditional Compilation Options
+ **************************************************************************/
+#define USE_DEBUG 0
+
+/* Allocation, split and merge counters behind buddy_stats(). The free
+ * block counts are kept either way. Build with -DUSE_STATS=0 to drop them */
+#ifndef USE_STATS
+#define USE_STATS 1
+#endif
+
+/* Abort with a message on an invalid free instead of counting and ignoring
+ * it. Build with -DUSE_HARDENED=1 */
+#ifndef USE_HARDENED
+#define USE_HARDENED 0
+#endif
+
+/**************************************************************************
+ * Included Files
+ **************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#include "buddy.h"
+
+/**************************************************************************
+ * Public Definitions
+ **************************************************************************/
+
+/* geometry of the default arena behind buddy_init() */
+#define MIN_ORDER 12
+#define MAX_ORDER 20
+
+/* largest order of a block, beyond any address space in use */
+#define ORDER_LIMIT 48
+
+/* the memory and the metadata of an arena, relative to its header */
+#define MEMORY(b) ((char *)((uintptr_t)(b) + (b)->memory_off))
+#define TREE(b) ((uint8_t *)((b) + 1))
+#define ORDERS(b) (TREE(b) + (b)->nr_nodes)
+#define MARKS(b) ((uint64_t *)((char *)(b) + MARKS_AT(sizeof(buddy_t) + (b)->nr_nodes + (b)->nr_pages)))
+
+/* offset of the marks behind metadata of the given length */
+#define MARKS_AT(len) (((len) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+#define PAGE_SIZE(b) (1UL<<(b)->min_order)
+/* page index to address */
+#define PAGE_TO_ADDR(b, page_idx) (void *)(((unsigned long)(page_idx)*PAGE_SIZE(b)) + MEMORY(b))
+
+/* address to page index */
+#define ADDR_TO_PAGE(b, addr) ((unsigned long)((void *)(addr) - (void *)MEMORY(b)) / PAGE_SIZE(b))
+
+/* huge page of the BUDDY_MAP_HUGETLB mappings */
+#define HUGE_PAGE_ORDER 21
+#define HUGE_PAGE_SIZE (1UL << HUGE_PAGE_ORDER)
+
+/* bit of orders[] set while the block a page heads is handed out, as long
+ * as the epoch in its mark is the arena's, see buddy_arena_reset() */
+#define ORDER_LIVE 0x80
+
+/* bit of orders[] set on every piece of a trimmed block that another piece
+ * follows, see buddy_arena_set_trim() */
+#define ORDER_TRIMMED 0x40
+
+/* the epoch sits in the top bits of a mark, the bytes asked for less one or
+ * the lazy link below them */
+#define MARK_SHIFT 48
+#define MARK_VALUE ((1ULL << MARK_SHIFT) - 1)
+
+/* whether page i heads a block handed out since the last reset */
+#define IS_LIVE(b, i) ((ORDERS(b)[i] & ORDER_LIVE) && (MARKS(b)[i] >> MARK_SHIFT) == (b)->epoch)
+
+/* bits of orders[] that hold the order */
+#define ORDER_MASK 0x3f
+
+/* tree node of the block of order o starting at page page_idx */
+#define NODE_OF(b, o, page_idx) ((1UL << ((b)->top_order - (o))) + ((unsigned long)(page_idx) >> ((o) - (b)->min_order)))
+
+/* first page of the block of tree node n, which has order o */
+#define NODE_TO_PAGE(b, n, o) (((n) - (1UL << ((b)->top_order - (o)))) << ((o) - (b)->min_order))
+
+/* the lock of a shared arena, see buddy_create_shared() */
+#define BUDDY_LOCK(b) do { if ((b)->shared) buddy_lock(b); } while (0)
+#define BUDDY_UNLOCK(b) do { if ((b)->shared) pthread_mutex_unlock(&(b)->lock); } while (0)
+
+/* identifies a header set up by buddy_create_shared() */
+#define SHARED_MAGIC 0x6275646479747265ULL
+
+/* identifies a header written by buddy_arena_snapshot() */
+#define SNAPSHOT_MAGIC 0x627564647974736eULL
+
+#if USE_STATS
+#  define STAT_ADD(b, field, n) ((b)->stats.field += (n))
+#else
+#  define STAT_ADD(b, field, n)
+#endif
+
+#if USE_DEBUG == 1
+#  define PDEBUG(fmt, ...) \
+	fprintf(stderr, "%s(), %s:%d: " fmt,			\
+		__func__, __FILE__, __LINE__, ##__VA_ARGS__)
+#  define IFDEBUG(x) x
+#else
+#  define PDEBUG(fmt, ...)
+#  define IFDEBUG(x)
+#endif
+
+/**************************************************************************
+ * Public Types
+ **************************************************************************/
+
+/**
+ * One buddy arena. Blocks are aligned to their size relative to memory.
+ */
+struct buddy {
+	uint64_t magic;       ///< SHARED_MAGIC once a shared arena is set up, SNAPSHOT_MAGIC in a snapshot
+	uintptr_t memory_off; ///< start of the managed memory, relative to the header
+	size_t size;          ///< managed bytes, a multiple of the page size
+	int min_order;        ///< order of a page, the smallest block
+	int max_order;        ///< order of the largest block the arena can hold
+	int top_order;        ///< order of the root node, may exceed max_order
+	int align_order;      ///< blocks up to this order are aligned absolutely
+	int release_order;    ///< free blocks of this order and up go back to the OS
+	int trim;             ///< 1 to give the pages past the end of a request back
+	size_t map_len;       ///< length of the mapping memory is in, 0 if not owned
+	size_t image_len;     ///< length of the mapping the header and everything behind it are in, 0 if allocated
+	int shared;           ///< 1 while other processes use the arena too
+	unsigned long nr_pages;  ///< number of managed pages
+	unsigned long nr_nodes;  ///< number of tree nodes plus one, node 0 is unused
+	buddy_stats_t stats;  ///< free block counts and event counters
+	int lazy_watermark;   ///< most lazily freed blocks per order, 0 merges eagerly
+	uint32_t lazy_count[BUDDY_NR_ORDERS];  ///< lazily freed blocks per order
+	unsigned long lazy[BUDDY_NR_ORDERS];   ///< stack of lazily freed blocks per order, head page + 1
+	uint32_t lazy_blocks;                  ///< lazily freed blocks of all orders
+	uint16_t epoch;                        ///< epoch of the live marks, bumped by a reset
+	pthread_mutex_t lock;                  ///< protects the arena when it is shared
+	/* behind the header: tree, largest free order + 1 per node; orders, order
+	 * of the allocated block or piece each page heads plus ORDER_LIVE and
+	 * ORDER_TRIMMED; marks, per head page the epoch and the bytes asked for
+	 * less one while the block is handed out, and the next lazily freed block
+	 * of its order, page + 1, while it is on a lazy stack */
+};
+
+/**************************************************************************
+ * Global Variables
+ **************************************************************************/
+/* memory area of the default arena, aligned like its largest block */
+char g_memory[1<<MAX_ORDER] __attribute__((aligned(1<<MAX_ORDER)));
+
+/* default arena used by the buddy_init()/buddy_alloc()/buddy_free() API */
+static buddy_t *g_buddy;
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/**
+ * Take the lock of a shared arena
+ *
+ * The lock is robust: when a process dies holding it, the next one to lock
+ * gets it anyway. The blocks the dead process held stay allocated, and an
+ * operation it was in the middle of may have left the tree broken, which
+ * buddy_arena_check() reports.
+ *
+ * @param b arena
+ */
+static void buddy_lock(buddy_t *b)
+{
+	if (pthread_mutex_lock(&b->lock) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&b->lock);
+	}
+}
+
+/**
+ * Push a lazily freed block on the stack of its order. The link lives in the
+ * marks of the head page, not in the block, which may be smaller than a
+ * pointer.
+ * @param b arena
+ * @param index head page of the block
+ * @param order order of the block
+ */
+static void lazy_push(buddy_t *b, unsigned long index, int order)
+{
+	MARKS(b)[index] = b->lazy[order];
+	b->lazy[order] = index + 1;
+}
+
+/**
+ * Pop a lazily freed block off the stack of an order, which must not be empty
+ * @param b arena
+ * @param order order of the stack
+ * @return head page of the block
+ */
+static unsigned long lazy_pop(buddy_t *b, int order)
+{
+	unsigned long index = b->lazy[order] - 1;
+
+	b->lazy[order] = MARKS(b)[index];
+	return index;
+}
+
+/**
+ * Recompute the value of a node from its children
+ * @param b arena
+ * @param node tree node
+ * @param order order of the node
+ */
+static void tree_update(buddy_t *b, unsigned long node, int order)
+{
+	uint8_t left = TREE(b)[2 * node];
+	uint8_t right = TREE(b)[2 * node + 1];
+
+	/* two free halves make a free block, as long as the arena can hold it */
+	if (left == order && right == order && order <= b->max_order)
+	{
+		TREE(b)[node] = order + 1;
+	}
+	else
+	{
+		TREE(b)[node] = left > right ? left : right;
+	}
+}
+
+/**
+ * Hand the memory of a free block back to the OS if it is large enough
+ * @param b arena
+ * @param node tree node of the block
+ * @param order order of the block
+ */
+static void buddy_release(buddy_t *b, unsigned long node, int order)
+{
+	if (order >= b->release_order)
+	{
+		madvise(PAGE_TO_ADDR(b, NODE_TO_PAGE(b, node, order)), 1UL << order, MADV_DONTNEED);
+	}
+}
+
+/**
+ * Recompute the ancestors of a node after it changed, up to the first one
+ * whose value stays the same. Two free halves becoming one free block are
+ * counted as a merge.
+ * @param b arena
+ * @param node tree node
+ * @param order order of the node
+ */
+static void tree_update_parents(buddy_t *b, unsigned long node, int order)
+{
+	while (node > 1)
+	{
+		node >>= 1;
+		order++;
+		uint8_t old = TREE(b)[node];
+		tree_update(b, node, order);
+		/* nothing above can change either */
+		if (TREE(b)[node] == old)
+		{
+			break;
+		}
+		if (TREE(b)[node] == order + 1)
+		{
+			b->stats.free_blocks[order - 1] -= 2;
+			b->stats.free_blocks[order]++;
+			STAT_ADD(b, merges[order], 1);
+		}
+	}
+}
+
+/**
+ * Count the free blocks of every order below a node
+ * @param b arena
+ * @param node tree node
+ * @param order order of the node
+ * @param cnt free block count per order
+ */
+static void count_free(buddy_t *b, unsigned long node, int order, unsigned long *cnt)
+{
+	if (TREE(b)[node] == 0)
+	{
+		return;
+	}
+	if (TREE(b)[node] == order + 1)
+	{
+		cnt[order]++;
+		return;
+	}
+	count_free(b, 2 * node, order - 1, cnt);
+	count_free(b, 2 * node + 1, order - 1, cnt);
+}
+
+/**
+ * Bytes an allocated block spans, over all of its pieces if it was trimmed
+ * @param b arena
+ * @param index head page of the block
+ */
+static size_t block_bytes(buddy_t *b, unsigned long index)
+{
+	size_t bytes = 0;
+
+	for (;;)
+	{
+		int order = ORDERS(b)[index] & ORDER_MASK;
+
+		bytes += 1UL << order;
+		if (!(ORDERS(b)[index] & ORDER_TRIMMED))
+		{
+			return bytes;
+		}
+		index += 1UL << (order - b->min_order);
+	}
+}
+
+#if USE_STATS
+/**
+ * Account for a block handed out to the caller
+ * @param b arena
+ * @param index head page of the block, with its order set
+ * @param size bytes requested
+ */
+static void stats_alloc(buddy_t *b, unsigned long index, size_t size)
+{
+	b->stats.bytes_allocated += block_bytes(b, index);
+	b->stats.bytes_requested += size;
+	b->stats.allocs[ORDERS(b)[index] & ORDER_MASK]++;
+	if (b->stats.bytes_allocated > b->stats.peak_bytes_allocated)
+	{
+		b->stats.peak_bytes_allocated = b->stats.bytes_allocated;
+	}
+}
+
+/**
+ * Account for a block given back by the caller
+ * @param b arena
+ * @param index head page of the block, its pieces still allocated
+ */
+static void stats_free(buddy_t *b, unsigned long index)
+{
+	b->stats.bytes_allocated -= block_bytes(b, index);
+	b->stats.bytes_requested -= (MARKS(b)[index] & MARK_VALUE) + 1;
+	b->stats.frees[ORDERS(b)[index] & ORDER_MASK]++;
+}
+#else
+#  define stats_alloc(b, index, size)
+#  define stats_free(b, index)
+#endif
+
+/**
+ * Page an address given back by the caller starts
+ * @param b arena
+ * @param addr the address
+ * @return page index, or -1 if addr is outside the arena or not at the start
+ * of a page
+ */
+static long addr_to_page_checked(buddy_t *b, void *addr)
+{
+	unsigned long offset = (unsigned long)addr - (unsigned long)MEMORY(b);
+
+	if (offset >= b->size || (offset & (PAGE_SIZE(b) - 1)) != 0)
+	{
+		return -1;
+	}
+	return offset >> b->min_order;
+}
+
+/**
+ * Report a free of an address that is not a live block
+ * @param b arena
+ * @param addr the address
+ */
+static void invalid_free(buddy_t *b, void *addr)
+{
+	b->stats.invalid_frees++;
+#if USE_HARDENED
+	fprintf(stderr, "buddy: invalid free of %p\n", addr);
+	abort();
+#else
+	(void)addr;
+#endif
+}
+
+/**
+ * Work out the geometry of an arena over a memory region
+ * @param len length of the memory region in bytes
+ * @param min_order order of the smallest block handed out
+ * @param nr_pages receives the number of pages
+ * @param meta_size receives the bytes of the header with the metadata behind it
+ * @return 0, or -1 if no arena fits the arguments
+ */
+static int arena_geometry(size_t len, int min_order, unsigned long *nr_pages, size_t *meta_size)
+{
+	if (min_order < 0 || min_order > ORDER_LIMIT || len < (1UL << min_order))
+	{
+		return -1;
+	}
+
+	*nr_pages = len >> min_order;
+	size_t size = (size_t)*nr_pages << min_order;
+	int max_order = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(size);
+	int top_order = max_order + ((size & (size - 1)) != 0);
+
+	*meta_size = sizeof(buddy_t) + (2UL << (top_order - min_order)) + *nr_pages;
+	/* the marks go last, aligned */
+	*meta_size = MARKS_AT(*meta_size) + *nr_pages * sizeof(uint64_t);
+	return 0;
+}
+
+/**
+ * Mark the part of the region below a node free, as the largest blocks that
+ * fit
+ *
+ * Only the nodes along the end of the region are written: below a free
+ * block the values are stale anyway, and nothing below a node past the end
+ * is ever read. Setting up the whole tree takes a couple of nodes per order.
+ *
+ * @param b arena
+ * @param node tree node
+ * @param order order of the node
+ * @param first first page of the node's block
+ * @return the new value of the node
+ */
+static uint8_t tree_fill(buddy_t *b, unsigned long node, int order, unsigned long first)
+{
+	unsigned long pages = 1UL << (order - b->min_order);
+	uint8_t value;
+
+	if (first >= b->nr_pages)
+	{
+		value = 0;
+	}
+	else if (first + pages <= b->nr_pages && order <= b->max_order)
+	{
+		value = order + 1;
+	}
+	else
+	{
+		uint8_t left = tree_fill(b, 2 * node, order - 1, first);
+		uint8_t right = tree_fill(b, 2 * node + 1, order - 1, first + pages / 2);
+		value = left > right ? left : right;
+	}
+	TREE(b)[node] = value;
+	return value;
+}
+
+/**
+ * Mark the whole region of an arena free and start the counters over
+ * @param b arena header, set up by arena_init()
+ */
+static void arena_fill(buddy_t *b)
+{
+	TREE(b)[0] = 0;
+	tree_fill(b, 1, b->top_order, 0);
+
+	/* from here on the counts follow every split and merge */
+	memset(&b->stats, 0, sizeof(b->stats));
+	count_free(b, 1, b->top_order, b->stats.free_blocks);
+
+	memset(b->lazy_count, 0, sizeof(b->lazy_count));
+	memset(b->lazy, 0, sizeof(b->lazy));
+	b->lazy_blocks = 0;
+}
+
+/**
+ * Set up an arena header and mark the whole region free in the tree
+ * @param b arena header, followed by the room for its metadata with the
+ * orders zeroed
+ * @param mem start of the memory region
+ * @param nr_pages number of pages, see arena_geometry()
+ * @param min_order order of a page
+ * @param shared 1 for an arena in shared memory, 0 for one of this process only
+ */
+static void arena_init(buddy_t *b, void *mem, unsigned long nr_pages, int min_order, int shared)
+{
+	size_t size = (size_t)nr_pages << min_order;
+	int max_order = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(size);
+	int top_order = max_order + ((size & (size - 1)) != 0);
+
+	b->magic = 0;
+	b->memory_off = (uintptr_t)mem - (uintptr_t)b;
+	b->size = size;
+	b->min_order = min_order;
+	b->max_order = max_order > ORDER_LIMIT ? ORDER_LIMIT : max_order;
+	b->top_order = top_order;
+	/* blocks are aligned relative to memory, so absolutely only as far as it is */
+	b->align_order = __builtin_ctzl((unsigned long)mem);
+	if (b->align_order > b->max_order)
+	{
+		b->align_order = b->max_order;
+	}
+	b->release_order = INT_MAX;
+	b->map_len = 0;
+	b->image_len = 0;
+	b->shared = shared;
+	b->nr_pages = nr_pages;
+	b->epoch = 1;
+	b->nr_nodes = 2UL << (top_order - min_order);
+	b->lazy_watermark = 0;
+	b->trim = 0;
+
+	arena_fill(b);
+
+	/* a robust lock, so that a process dying inside the allocator does not
+	 * hang the others */
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	if (shared)
+	{
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	pthread_mutex_init(&b->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * Create a buddy arena on top of a caller supplied memory region
+ *
+ * The tree covers the next power of two above the region; leaves past its
+ * end never become free. Blocks are aligned relative to mem, so mem should
+ * be aligned to the largest alignment buddy_arena_alloc_aligned() is asked
+ * for. The tree and the per-page orders are allocated in
+ * one block together with the arena header and released by buddy_destroy(),
+ * the memory itself stays owned by the caller.
+ *
+ * @param mem start of the memory region
+ * @param len length of the memory region in bytes
+ * @param min_order order of the smallest block handed out
+ * @return the new arena, or NULL if the arguments are unusable or out of memory
+ */
+buddy_t *buddy_create(void *mem, size_t len, int min_order)
+{
+	unsigned long nr_pages;
+	size_t meta_size;
+
+	if (mem == NULL || arena_geometry(len, min_order, &nr_pages, &meta_size) != 0)
+	{
+		return NULL;
+	}
+
+	/* zeroed, so no page heads an allocated block */
+	buddy_t *b = calloc(1, meta_size);
+	if (b == NULL)
+	{
+		return NULL;
+	}
+
+	arena_init(b, mem, nr_pages, min_order, 0);
+	return b;
+}
+
+/**
+ * Release the metadata of an arena
+ *
+ * An arena in shared memory is only unmapped from the calling process; it
+ * lives on for the other processes until its name is removed with
+ * shm_unlink() and the last of them has let go of it. A restored arena is
+ * unmapped from its snapshot file.
+ *
+ * @param b arena to destroy, may be NULL
+ */
+void buddy_destroy(buddy_t *b)
+{
+	if (b == NULL)
+	{
+		return;
+	}
+	if (b->shared)
+	{
+		munmap(b, b->image_len);
+		return;
+	}
+	pthread_mutex_destroy(&b->lock);
+	if (b->map_len != 0)
+	{
+		munmap(MEMORY(b), b->map_len);
+	}
+	if (b->image_len != 0)
+	{
+		munmap(b, b->image_len);
+		return;
+	}
+	free(b);
+}
+
+/**
+ * Create a buddy arena on its own anonymous mapping
+ *
+ * The mapping reserves no swap and is aligned to the largest block, so pages
+ * are only committed once a block is touched and buddy_arena_alloc_aligned()
+ * works up to the arena size. Free blocks that coalesce to release_order or
+ * above are handed back with MADV_DONTNEED, so the arena shrinks in RSS when
+ * it goes idle. buddy_destroy() unmaps the memory.
+ *
+ * @param len arena size in bytes
+ * @param min_order order of the smallest block handed out
+ * @param release_order order from which free blocks are returned to the OS,
+ * or -1 to keep everything
+ * @param flags BUDDY_MAP_HUGETLB and BUDDY_MAP_THP
+ * @return the new arena, or NULL if the arguments are unusable or the mapping
+ * failed
+ */
+buddy_t *buddy_create_mapped(size_t len, int min_order, int release_order, int flags)
+{
+	if (len == 0)
+	{
+		return NULL;
+	}
+
+	int max_order = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(len);
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	size_t align = 1UL << (max_order < ORDER_LIMIT ? max_order : ORDER_LIMIT);
+	size_t map_len = len;
+
+	if (flags & BUDDY_MAP_HUGETLB)
+	{
+		/* huge pages come aligned, and can only be dropped whole */
+		map_flags |= MAP_HUGETLB;
+		map_len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		align = HUGE_PAGE_SIZE;
+		if (release_order >= 0 && release_order < HUGE_PAGE_ORDER)
+		{
+			release_order = HUGE_PAGE_ORDER;
+		}
+	}
+
+	/* map one extra block to cut an aligned arena out of */
+	size_t extra = (flags & BUDDY_MAP_HUGETLB) ? 0 : align;
+	char *map = mmap(NULL, map_len + extra, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+	char *mem = (char *)(((unsigned long)map + align - 1) & ~(align - 1));
+	if (mem > map)
+	{
+		munmap(map, mem - map);
+	}
+	if (map + map_len + extra > mem + map_len)
+	{
+		munmap(mem + map_len, map + map_len + extra - (mem + map_len));
+	}
+
+	if (flags & BUDDY_MAP_THP)
+	{
+		madvise(mem, map_len, MADV_HUGEPAGE);
+	}
+
+	buddy_t *b = buddy_create(mem, len, min_order);
+	if (b == NULL)
+	{
+		munmap(mem, map_len);
+		return NULL;
+	}
+	b->map_len = map_len;
+	b->release_order = release_order >= 0 ? release_order : INT_MAX;
+	return b;
+}
+
+/**
+ * Create a buddy arena in named shared memory
+ *
+ * The header, the tree and the memory all sit in one shm_open() object, and
+ * the header finds the rest by offset, so every process that opens the
+ * arena with buddy_open_shared() can allocate and free in it wherever the
+ * object is mapped. Every operation on the arena takes its process-shared
+ * robust lock. Blocks are aligned to the system page size at most. Pass
+ * blocks between processes as buddy_offset() and turn them back with
+ * buddy_address(). All processes must use the same build of the allocator.
+ *
+ * @param name name of the shared memory object, "/name"; it must not exist yet
+ * @param len arena size in bytes
+ * @param min_order order of the smallest block handed out
+ * @return the new arena, or NULL if the arguments are unusable or the object
+ * cannot be created, with errno set
+ */
+buddy_t *buddy_create_shared(const char *name, size_t len, int min_order)
+{
+	unsigned long nr_pages;
+	size_t meta_size;
+
+	if (arena_geometry(len, min_order, &nr_pages, &meta_size) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* header and metadata, then the memory on a page boundary */
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t memory_off = (meta_size + page_size - 1) & ~(page_size - 1);
+	size_t image_len = memory_off + ((size_t)nr_pages << min_order);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	char *map = MAP_FAILED;
+	if (ftruncate(fd, image_len) == 0)
+	{
+		map = mmap(NULL, image_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		int err = errno;
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+
+	buddy_t *b = (buddy_t *)map;
+	arena_init(b, map + memory_off, nr_pages, min_order, 1);
+	b->image_len = image_len;
+	/* only the page alignment of the mapping holds in every process */
+	b->align_order = __builtin_ctzl(page_size);
+	if (b->align_order > b->max_order)
+	{
+		b->align_order = b->max_order;
+	}
+	__atomic_store_n(&b->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+	return b;
+}
+
+/**
+ * Open a buddy arena created by buddy_create_shared() in another process
+ *
+ * @param name name of the shared memory object
+ * @return the arena, or NULL if there is no such object or it does not hold
+ * a complete arena, with errno set
+ */
+buddy_t *buddy_open_shared(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	buddy_t *b = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*b))
+	{
+		b = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	else
+	{
+		errno = EINVAL;
+	}
+	close(fd);
+	if (b == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	/* the creator may not be done yet, or the object is something else */
+	if (__atomic_load_n(&b->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC ||
+	    b->image_len != (size_t)st.st_size)
+	{
+		munmap(b, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return b;
+}
+
+/**
+ * Offset of an address from the start of the arena memory
+ *
+ * A block has the same offset in every process that maps a shared arena, so
+ * offsets can be handed to other processes where pointers cannot.
+ *
+ * @param b arena
+ * @param addr address inside the arena
+ * @return the offset
+ */
+size_t buddy_offset(buddy_t *b, void *addr)
+{
+	return (char *)addr - MEMORY(b);
+}
+
+/**
+ * Address of an offset into the arena memory, see buddy_offset()
+ *
+ * @param b arena
+ * @param offset offset from the start of the arena memory
+ * @return the address
+ */
+void *buddy_address(buddy_t *b, size_t offset)
+{
+	return MEMORY(b) + offset;
+}
+
+/**
+ * Free every block of an arena at once
+ *
+ * The arena goes back to the state buddy_create() left it in, apart from its
+ * lazy coalescing watermark, trim mode and release order. The tree is set up
+ * again along the end of the region only, a couple of nodes per order, and
+ * the live marks go stale at once as the epoch is bumped, so a reset takes
+ * constant time. Only when the 16 bit epoch wraps, once every 65535 resets,
+ * are the orders cleared. The memory is not handed back to the OS. No other
+ * process may use the arena meanwhile, and every block of it is invalid
+ * afterwards; freeing one counts as an invalid free.
+ *
+ * @param b arena
+ */
+void buddy_arena_reset(buddy_t *b)
+{
+	BUDDY_LOCK(b);
+	if (++b->epoch == 0)
+	{
+		/* no mark may look live in a new round of epochs */
+		memset(ORDERS(b), 0, b->nr_pages);
+		b->epoch = 1;
+	}
+	arena_fill(b);
+	BUDDY_UNLOCK(b);
+}
+
+/**
+ * Initialize the buddy system
+ *
+ * Creates the default arena over g_memory, or resets it with
+ * buddy_arena_reset(), back to eager coalescing and whole blocks, if it is
+ * there already.
+ */
+void buddy_init()
+{
+	if (g_buddy != NULL && MEMORY(g_buddy) == g_memory)
+	{
+		buddy_arena_reset(g_buddy);
+		buddy_arena_set_lazy(g_buddy, 0);
+		buddy_arena_set_trim(g_buddy, 0);
+		return;
+	}
+	buddy_destroy(g_buddy);
+	g_buddy = buddy_create(g_memory, sizeof(g_memory), MIN_ORDER);
+}
+
+/**
+ * Free every block of the default arena at once, see buddy_arena_reset()
+ */
+void buddy_reset()
+{
+	buddy_arena_reset(g_buddy);
+}
+
+/**
+ * Split a block of memory and update the tree with the buddy
+ * @param b arena
+ * @param order order of memory size
+ * @param index of the page
+ */
+static void buddy_split(buddy_t *b, int order, unsigned long index)
+{
+	unsigned long node = NODE_OF(b, order, index) ^ 1;
+
+	TREE(b)[node] = order + 1;
+	b->stats.free_blocks[order]++;
+	STAT_ADD(b, splits[order + 1], 1);
+	tree_update_parents(b, node, order);
+}
+
+/**
+ * Split a block of memory of the default arena and update the tree with the buddy
+ * @param order order of memory size
+ * @param index of the page
+ */
+void split(int order, unsigned long index)
+{
+	buddy_split(g_buddy, order, index);
+}
+
+/**
+ * Converts order to number of bytes, basically 2 to the nth power
+ * @param order order of memory size
+ * @return memory size in bytes
+ */
+size_t order_to_bytes(int order)
+{
+	return (size_t)1 << order;
+}
+
+/**
+ * Find the order of the smallest block that holds a request
+ *
+ * The order is the bit length of size - 1, so it takes one count leading
+ * zeros instead of a loop over the orders.
+ *
+ * @param b arena
+ * @param size size in bytes
+ * @return order of the block, or -1 if no block of the arena can hold size
+ */
+static int size_to_order(buddy_t *b, size_t size)
+{
+	if (size == 0 || size > order_to_bytes(b->max_order))
+	{
+		return -1;
+	}
+
+	int order = size > 1 ? (int)(sizeof(size_t) * CHAR_BIT) - __builtin_clzl(size - 1) : 0;
+	return order < b->min_order ? b->min_order : order;
+}
+
+/**
+ * Pages a block must keep for a request, all of them unless the arena trims
+ * @param b arena
+ * @param order order of the block
+ * @param size bytes requested
+ */
+static unsigned long pages_needed(buddy_t *b, int order, size_t size)
+{
+	if (!b->trim)
+	{
+		return 1UL << (order - b->min_order);
+	}
+	return (size + PAGE_SIZE(b) - 1) >> b->min_order;
+}
+
+/**
+ * Give the part of an allocated block past its first pages back
+ *
+ * Walks down from the block's node. Every upper half that lies wholly past
+ * the pages kept is marked a free block, every lower half that is kept
+ * whole becomes an allocated piece of its own, marked ORDER_TRIMMED unless
+ * it is the last one, and the nodes on the way are recomputed from the
+ * bottom. The pieces are the largest aligned ones that fit, at most one per
+ * order.
+ *
+ * @param b arena
+ * @param index head page of the block, allocated in the tree
+ * @param order order of the block
+ * @param pages pages to keep, fewer than the block has
+ */
+static void buddy_trim_block(buddy_t *b, unsigned long index, int order, unsigned long pages)
+{
+	unsigned long node = NODE_OF(b, order, index);
+	unsigned long top = node;
+	int top_order = order;
+
+	while (pages < (1UL << (order - b->min_order)))
+	{
+		unsigned long half = 1UL << (order - 1 - b->min_order);
+
+		node = 2 * node;
+		order--;
+		STAT_ADD(b, splits[order + 1], 1);
+		if (pages <= half)
+		{
+			/* the upper half is all tail */
+			buddy_release(b, node + 1, order);
+			TREE(b)[node + 1] = order + 1;
+			b->stats.free_blocks[order]++;
+		}
+		else
+		{
+			/* the lower half is kept whole, go on in the upper one */
+			TREE(b)[node] = 0;
+			ORDERS(b)[index] = order | ORDER_TRIMMED;
+			index += half;
+			pages -= half;
+			node++;
+		}
+	}
+	TREE(b)[node] = 0;
+	ORDERS(b)[index] = order;
+	for (int o = order + 1; o <= top_order; o++)
+	{
+		node >>= 1;
+		tree_update(b, node, o);
+	}
+	tree_update_parents(b, top, top_order);
+}
+
+/**
+ * Mark a block taken from the tree or a lazy stack handed out, trimmed if
+ * the arena trims and the request leaves whole pages of it unused
+ * @param b arena
+ * @param index head page of the block
+ * @param order order of the block
+ * @param size bytes requested
+ * @return memory block address
+ */
+static void *buddy_hand_out(buddy_t *b, unsigned long index, int order, size_t size)
+{
+	unsigned long pages = pages_needed(b, order, size);
+
+	ORDERS(b)[index] = order;
+	if (pages < (1UL << (order - b->min_order)))
+	{
+		buddy_trim_block(b, index, order, pages);
+	}
+	ORDERS(b)[index] |= ORDER_LIVE;
+	MARKS(b)[index] = (uint64_t)b->epoch << MARK_SHIFT | (size - 1);
+	stats_alloc(b, index, size);
+	return PAGE_TO_ADDR(b, index);
+}
+
+/**
+ * Mark a block free in the tree and merge it with its free buddies
+ * @param b arena
+ * @param index head page of the block
+ * @param order order of the block
+ */
+static void buddy_free_block(buddy_t *b, unsigned long index, int order)
+{
+	unsigned long node = NODE_OF(b, order, index);
+
+	TREE(b)[node] = order + 1;
+	b->stats.free_blocks[order]++;
+	tree_update_parents(b, node, order);
+
+	/* release the block the freed one has been merged into */
+	while (node > 1 && TREE(b)[node >> 1] == order + 2)
+	{
+		node >>= 1;
+		order++;
+	}
+	buddy_release(b, node, order);
+}
+
+/**
+ * Give every lazily freed block back to the tree
+ * @param b arena
+ * @return 1 if there was anything to give back
+ */
+static int buddy_coalesce_lazy(buddy_t *b)
+{
+	if (b->lazy_blocks == 0)
+	{
+		return 0;
+	}
+	for (int o = b->min_order; o <= b->max_order; o++)
+	{
+		while (b->lazy[o] != 0)
+		{
+			unsigned long index = lazy_pop(b, o);
+
+			b->stats.free_blocks[o]--;
+			buddy_free_block(b, index, o);
+		}
+		b->lazy_count[o] = 0;
+	}
+	b->lazy_blocks = 0;
+	return 1;
+}
+
+/**
+ * Hand out a block of an order
+ *
+ * Walks down from the root towards the smallest block that satisfies the
+ * request. At every level the child with the smaller sufficient free order
+ * is taken, the left one on a tie, so small requests are carved out of the
+ * smallest free blocks available. A free block on the way is split by
+ * marking both halves free. A lazily freed block of the order is reused
+ * without touching the tree, and if the tree has nothing large enough the
+ * lazily freed blocks are merged into it first.
+ *
+ * @param b arena
+ * @param alloc_size order of the block
+ * @param size bytes requested, for the statistics and for trimming
+ * @return memory block address, or NULL if no block is large enough
+ */
+static void *buddy_alloc_block(buddy_t *b, int alloc_size, size_t size)
+{
+	if (b->lazy[alloc_size] != 0)
+	{
+		unsigned long index = lazy_pop(b, alloc_size);
+
+		b->lazy_count[alloc_size]--;
+		b->lazy_blocks--;
+		b->stats.free_blocks[alloc_size]--;
+		return buddy_hand_out(b, index, alloc_size, size);
+	}
+	if (TREE(b)[1] < alloc_size + 1 && buddy_coalesce_lazy(b) == 0)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		return NULL;
+	}
+	if (TREE(b)[1] < alloc_size + 1)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		return NULL;
+	}
+
+	unsigned long node = 1;
+	int order = b->top_order;
+	while (order > alloc_size)
+	{
+		unsigned long left = 2 * node;
+
+		/* a free block's children are stale, make them two free halves */
+		if (TREE(b)[node] == order + 1)
+		{
+			TREE(b)[left] = order;
+			TREE(b)[left + 1] = order;
+			b->stats.free_blocks[order]--;
+			b->stats.free_blocks[order - 1] += 2;
+			STAT_ADD(b, splits[order], 1);
+		}
+
+		uint8_t l = TREE(b)[left];
+		uint8_t r = TREE(b)[left + 1];
+		if (l > alloc_size && (r <= alloc_size || l <= r))
+		{
+			node = left;
+		}
+		else
+		{
+			node = left + 1;
+		}
+		order--;
+	}
+
+	TREE(b)[node] = 0;
+	b->stats.free_blocks[order]--;
+	tree_update_parents(b, node, order);
+
+	return buddy_hand_out(b, NODE_TO_PAGE(b, node, order), order, size);
+}
+
+/**
+ * Allocate a memory block.
+ *
+ * @param b arena
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_arena_alloc(buddy_t *b, size_t size)
+{
+	int alloc_size = size_to_order(b, size);
+	void *addr = NULL;
+
+	BUDDY_LOCK(b);
+	if (alloc_size < 0)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+	}
+	else
+	{
+		addr = buddy_alloc_block(b, alloc_size, size);
+	}
+	BUDDY_UNLOCK(b);
+	return addr;
+}
+
+/**
+ * Allocate a memory block aligned to a power of two.
+ *
+ * A block of order o is aligned to 2^o relative to the arena memory, so the
+ * block is simply taken at the larger of the size order and log2(align).
+ * That gives absolute alignment as far as the arena memory itself is
+ * aligned, which buddy_create() records.
+ *
+ * @param b arena
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two
+ * @return memory block address, or NULL if out of memory or if the arena
+ * memory is not aligned enough for align
+ */
+void *buddy_arena_alloc_aligned(buddy_t *b, size_t size, size_t align)
+{
+	int order = size_to_order(b, size);
+	void *addr = NULL;
+
+	BUDDY_LOCK(b);
+	if (order < 0 || align < 1 || (align & (align - 1)) != 0 ||
+	    __builtin_ctzl(align) > b->align_order)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+	}
+	else
+	{
+		if (__builtin_ctzl(align) > order)
+		{
+			order = __builtin_ctzl(align);
+		}
+		addr = buddy_alloc_block(b, order, size);
+	}
+	BUDDY_UNLOCK(b);
+	return addr;
+}
+
+/**
+ * Allocate a memory block from the default arena.
+ *
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_alloc(size_t size)
+{
+	return buddy_arena_alloc(g_buddy, size);
+}
+
+/**
+ * Allocate an aligned memory block from the default arena.
+ *
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two up to the arena size
+ * @return memory block address
+ */
+void *buddy_alloc_aligned(size_t size, size_t align)
+{
+	return buddy_arena_alloc_aligned(g_buddy, size, align);
+}
+
+/**
+ * Free every piece of an allocated block, one piece only unless it was
+ * trimmed. Every piece goes on the lazy stack of its order or back to the
+ * tree on its own.
+ * @param b arena
+ * @param index head page of the block, its live mark already taken off
+ */
+static void buddy_free_pieces(buddy_t *b, unsigned long index)
+{
+	for (;;)
+	{
+		int order = ORDERS(b)[index] & ORDER_MASK;
+		int more = ORDERS(b)[index] & ORDER_TRIMMED;
+		unsigned long next = index + (1UL << (order - b->min_order));
+
+		/* the next piece is still allocated, so no merge reaches it */
+		ORDERS(b)[index] = order;
+		if (b->lazy_count[order] < (uint32_t)b->lazy_watermark)
+		{
+			lazy_push(b, index, order);
+			b->lazy_count[order]++;
+			b->lazy_blocks++;
+			b->stats.free_blocks[order]++;
+		}
+		else
+		{
+			buddy_free_block(b, index, order);
+		}
+		if (!more)
+		{
+			return;
+		}
+		index = next;
+	}
+}
+
+/**
+ * Free an allocated memory block.
+ *
+ * Marks the block free and recomputes its ancestors; two free buddies merge
+ * on the way up. In lazy mode the block is pushed on the stack of its order
+ * instead, and stays allocated in the tree, as long as the order holds fewer
+ * than lazy_watermark such blocks. Every piece of a trimmed block is freed
+ * that way.
+ *
+ * Only the head page of a block handed out is live, so a pointer
+ * outside the arena or into the middle of a block, and a block that is free
+ * already, are turned away in O(1) and counted in invalid_frees; the
+ * hardened build aborts.
+ *
+ * @param b arena
+ * @param addr memory block address to be freed, may be NULL
+ * @return 0, or -1 if addr is not a live block of the arena
+ */
+int buddy_arena_free(buddy_t *b, void *addr)
+{
+	if (addr == NULL)
+	{
+		return 0;
+	}
+	long index = addr_to_page_checked(b, addr);
+
+	BUDDY_LOCK(b);
+	if (index < 0 || !IS_LIVE(b, index))
+	{
+		invalid_free(b, addr);
+		BUDDY_UNLOCK(b);
+		return -1;
+	}
+	ORDERS(b)[index] &= ~ORDER_LIVE;
+	stats_free(b, index);
+	buddy_free_pieces(b, index);
+	BUDDY_UNLOCK(b);
+	return 0;
+}
+
+/**
+ * Free a memory block of the default arena.
+ *
+ * @param addr memory block address to be freed, may be NULL
+ * @return 0, or -1 if addr is not a live block
+ */
+int buddy_free(void *addr)
+{
+	return buddy_arena_free(g_buddy, addr);
+}
+
+/**
+ * Switch an arena between eager and lazy coalescing
+ *
+ * In lazy mode up to watermark freed blocks per order are kept aside
+ * unmerged, so alloc/free cycles of the same size reuse them without walking
+ * the tree. They are merged once an allocation finds no block large enough,
+ * or when the watermark is lowered.
+ *
+ * @param b arena
+ * @param watermark most unmerged free blocks per order, 0 to merge eagerly
+ * @return 0
+ */
+int buddy_arena_set_lazy(buddy_t *b, int watermark)
+{
+	BUDDY_LOCK(b);
+	if (watermark < b->lazy_watermark)
+	{
+		buddy_coalesce_lazy(b);
+	}
+	b->lazy_watermark = watermark > 0 ? watermark : 0;
+	BUDDY_UNLOCK(b);
+	return 0;
+}
+
+/**
+ * Switch the default arena between eager and lazy coalescing
+ *
+ * @param watermark most unmerged free blocks per order, 0 to merge eagerly
+ * @return 0
+ */
+int buddy_set_lazy(int watermark)
+{
+	return buddy_arena_set_lazy(g_buddy, watermark);
+}
+
+/**
+ * Switch an arena between whole and trimmed blocks
+ *
+ * A trimmed block still comes out of a power of two node, but only the
+ * pages the request covers stay allocated, as up to one aligned piece per
+ * order below it; the tail nodes are marked free. Freeing the block frees
+ * every piece, and they merge with the tail again as far as it is still
+ * free. A trimmed block is moved rather than resized in place by
+ * buddy_arena_realloc(). Blocks allocated before the switch keep their size.
+ *
+ * @param b arena
+ * @param on 1 to trim, 0 for whole blocks
+ * @return 0
+ */
+int buddy_arena_set_trim(buddy_t *b, int on)
+{
+	BUDDY_LOCK(b);
+	b->trim = on != 0;
+	BUDDY_UNLOCK(b);
+	return 0;
+}
+
+/**
+ * Switch the default arena between whole and trimmed blocks
+ *
+ * @param on 1 to trim, 0 for whole blocks
+ * @return 0
+ */
+int buddy_set_trim(int on)
+{
+	return buddy_arena_set_trim(g_buddy, on);
+}
+
+/**
+ * Resize an allocated block in place
+ *
+ * Growing needs the right sibling of the block's node and of every ancestor
+ * below the new order to be a free block; they are taken over and the
+ * ancestor becomes the allocated node. Shrinking walks down the left children
+ * and marks every right sibling free. The order in orders[] is left to the
+ * caller.
+ *
+ * @param b arena
+ * @param index head page of the block
+ * @param new_order order the block should have
+ * @return 1 if the block now spans new_order, 0 if it cannot grow in place
+ */
+static int buddy_resize_block(buddy_t *b, unsigned long index, int new_order)
+{
+	int order = ORDERS(b)[index] & ORDER_MASK;
+	unsigned long node = NODE_OF(b, order, index);
+
+	if (new_order > order)
+	{
+		unsigned long n = node;
+		for (int o = order; o < new_order; o++, n >>= 1)
+		{
+			if ((n & 1) != 0 || TREE(b)[n + 1] != o + 1)
+			{
+				return 0;
+			}
+		}
+		for (int o = order; o < new_order; o++, node >>= 1)
+		{
+			TREE(b)[node + 1] = 0;
+			b->stats.free_blocks[o]--;
+			STAT_ADD(b, merges[o + 1], 1);
+		}
+		TREE(b)[node] = 0;
+		tree_update_parents(b, node, new_order);
+	}
+	else if (new_order < order)
+	{
+		for (int o = order - 1; o >= new_order; o--)
+		{
+			node = 2 * node;
+			buddy_release(b, node + 1, o);
+			TREE(b)[node + 1] = o + 1;
+			b->stats.free_blocks[o]++;
+			STAT_ADD(b, splits[o + 1], 1);
+		}
+		TREE(b)[node] = 0;
+		/* the path below the old node was stale, so recompute all of it */
+		for (int o = new_order + 1; o <= order; o++)
+		{
+			node >>= 1;
+			tree_update(b, node, o);
+		}
+		tree_update_parents(b, node, order);
+	}
+	return 1;
+}
+
+/**
+ * Change the size of an allocated block
+ *
+ * The block is resized in place when it shrinks, or when it grows and the
+ * buddies it needs are free; in trim mode the new block is trimmed as well.
+ * Otherwise, and always for a trimmed block, a new block is allocated, the
+ * data is copied over and the old block freed. A NULL addr allocates, a
+ * size of 0 frees. An addr that is not a live block is an invalid free.
+ *
+ * @param b arena
+ * @param addr memory block address, or NULL
+ * @param size new size in bytes
+ * @return address of the resized block, or NULL if no block of that size is
+ * available, in which case the old block is left as it was
+ */
+void *buddy_arena_realloc(buddy_t *b, void *addr, size_t size)
+{
+	if (addr == NULL)
+	{
+		return buddy_arena_alloc(b, size);
+	}
+	if (size == 0)
+	{
+		buddy_arena_free(b, addr);
+		return NULL;
+	}
+
+	long index = addr_to_page_checked(b, addr);
+	int order = size_to_order(b, size);
+
+	BUDDY_LOCK(b);
+	if (index < 0 || !IS_LIVE(b, index))
+	{
+		invalid_free(b, addr);
+		BUDDY_UNLOCK(b);
+		return NULL;
+	}
+	if (order < 0)
+	{
+		STAT_ADD(b, failed_allocs, 1);
+		BUDDY_UNLOCK(b);
+		return NULL;
+	}
+
+	size_t old_bytes = block_bytes(b, index);
+
+	/* a trimmed block is moved whole */
+	if (!(ORDERS(b)[index] & ORDER_TRIMMED) && buddy_resize_block(b, index, order))
+	{
+		stats_free(b, index);
+		buddy_hand_out(b, index, order, size);
+		BUDDY_UNLOCK(b);
+		return addr;
+	}
+	BUDDY_UNLOCK(b);
+
+	void *new_addr = buddy_arena_alloc(b, size);
+	if (new_addr == NULL)
+	{
+		return NULL;
+	}
+	/* a growing block, or a trimmed one of any size */
+	memcpy(new_addr, addr, old_bytes < size ? old_bytes : size);
+	buddy_arena_free(b, addr);
+	return new_addr;
+}
+
+/**
+ * Change the size of a block of the default arena
+ *
+ * @param addr memory block address, or NULL
+ * @param size new size in bytes
+ * @return address of the resized block, or NULL
+ */
+void *buddy_realloc(void *addr, size_t size)
+{
+	return buddy_arena_realloc(g_buddy, addr, size);
+}
+
+/**
+ * Allocate a burst of blocks of the same size
+ *
+ * Every block is a single walk down the tree, so there is nothing to share
+ * between them.
+ *
+ * @param b arena
+ * @param size size in bytes of every block
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated, less than n if the arena ran out
+ */
+int buddy_arena_alloc_bulk(buddy_t *b, size_t size, int n, void **out)
+{
+	int got = 0;
+
+	while (got < n && (out[got] = buddy_arena_alloc(b, size)) != NULL)
+	{
+		got++;
+	}
+	/* the call that failed has been counted already */
+	if (got < n)
+	{
+		BUDDY_LOCK(b);
+		STAT_ADD(b, failed_allocs, n - got - 1);
+		BUDDY_UNLOCK(b);
+	}
+	return got;
+}
+
+/**
+ * Allocate a burst of blocks of the same size from the default arena.
+ *
+ * @param size size in bytes of every block
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated
+ */
+int buddy_alloc_bulk(size_t size, int n, void **out)
+{
+	return buddy_arena_alloc_bulk(g_buddy, size, n, out);
+}
+
+/**
+ * Free a burst of blocks
+ *
+ * @param b arena
+ * @param addrs memory block addresses to be freed
+ * @param n number of addresses
+ */
+void buddy_arena_free_bulk(buddy_t *b, void **addrs, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		buddy_arena_free(b, addrs[i]);
+	}
+}
+
+/**
+ * Free a burst of blocks of the default arena.
+ *
+ * @param addrs memory block addresses to be freed
+ * @param n number of addresses
+ */
+void buddy_free_bulk(void **addrs, int n)
+{
+	buddy_arena_free_bulk(g_buddy, addrs, n);
+}
+
+/**
+ * Write a number in decimal
+ *
+ * @param p where to write
+ * @param v the number
+ * @return end of the digits
+ */
+static char *format_ulong(char *p, unsigned long v)
+{
+	char digits[24];
+	int n = 0;
+
+	do
+	{
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (n > 0)
+	{
+		*p++ = digits[--n];
+	}
+	return p;
+}
+
+/**
+ * Print the buddy system status---order oriented
+ *
+ * print free pages in each order, read from the free block counters. The
+ * line is formatted by hand and written in one go, as the simulator dumps
+ * after every command.
+ *
+ * @param b arena
+ */
+void buddy_arena_dump(buddy_t *b)
+{
+	/* count, size and unit of every order */
+	char line[BUDDY_NR_ORDERS * 40];
+	char *p = line;
+	int o;
+
+	BUDDY_LOCK(b);
+	for (o = b->min_order; o <= b->max_order; o++) {
+		unsigned long cnt = b->stats.free_blocks[o];
+		p = format_ulong(p, cnt);
+		*p++ = ':';
+		if (o >= 10) {
+			p = format_ulong(p, (1UL<<o)/1024);
+			*p++ = 'K';
+		} else {
+			p = format_ulong(p, 1UL<<o);
+			*p++ = 'B';
+		}
+		*p++ = ' ';
+	}
+	BUDDY_UNLOCK(b);
+	*p++ = '\n';
+	fwrite(line, 1, p - line, stdout);
+}
+
+/**
+ * Print the status of the default arena
+ */
+void buddy_dump()
+{
+	buddy_arena_dump(g_buddy);
+}
+
+/**
+ * Copy the statistics of an arena
+ *
+ * @param b arena
+ * @param st receives the statistics
+ */
+void buddy_arena_stats(buddy_t *b, buddy_stats_t *st)
+{
+	BUDDY_LOCK(b);
+	*st = b->stats;
+	BUDDY_UNLOCK(b);
+}
+
+/**
+ * Copy the statistics of the default arena
+ *
+ * @param st receives the statistics
+ */
+void buddy_stats(buddy_stats_t *st)
+{
+	buddy_arena_stats(g_buddy, st);
+}
+
+/**
+ * Order of the largest free block of an arena, straight from the root
+ * unless a larger block has been freed lazily
+ *
+ * @param b arena
+ * @return order of the largest free block, or -1 if nothing is free
+ */
+int buddy_arena_largest_free_order(buddy_t *b)
+{
+	BUDDY_LOCK(b);
+	int largest = TREE(b)[1] - 1;
+	for (int o = b->max_order; b->lazy_blocks != 0 && o > largest; o--)
+	{
+		if (b->lazy[o] != 0)
+		{
+			largest = o;
+		}
+	}
+	BUDDY_UNLOCK(b);
+	return largest;
+}
+
+/**
+ * Order of the largest free block of the default arena
+ *
+ * @return order of the largest free block, or -1 if nothing is free
+ */
+int buddy_largest_free_order()
+{
+	return buddy_arena_largest_free_order(g_buddy);
+}
+
+/**
+ * External fragmentation index of an arena for requests of an order
+ *
+ * The share of the free memory that sits in blocks too small to serve a
+ * request of that order. 0 means every free byte could serve it; close to 1
+ * means there is free memory, but only in small pieces.
+ *
+ * @param b arena
+ * @param order order of the request
+ * @return index between 0 and 1, 0 if nothing is free
+ */
+double buddy_arena_fragmentation(buddy_t *b, int order)
+{
+	double total = 0;
+	double unusable = 0;
+
+	for (int o = b->min_order; o <= b->max_order; o++)
+	{
+		double bytes = (double)b->stats.free_blocks[o] * (1UL << o);
+		total += bytes;
+		if (o < order)
+		{
+			unusable += bytes;
+		}
+	}
+	return total > 0 ? unusable / total : 0;
+}
+
+/**
+ * External fragmentation index of the default arena for requests of an order
+ *
+ * @param order order of the request
+ * @return index between 0 and 1, 0 if nothing is free
+ */
+double buddy_fragmentation(int order)
+{
+	return buddy_arena_fragmentation(g_buddy, order);
+}
+
+/**
+ * Check a subtree and sum up its free bytes
+ * @param b arena
+ * @param node tree node
+ * @param order order of the node
+ * @return free bytes below the node, or -1 if a value is inconsistent
+ */
+static long check_node(buddy_t *b, unsigned long node, int order)
+{
+	uint8_t value = TREE(b)[node];
+
+	/* an allocated block, whatever is below it is stale */
+	if (value == 0)
+	{
+		return 0;
+	}
+	if (value == order + 1)
+	{
+		unsigned long index = NODE_TO_PAGE(b, node, order);
+		int fits = order <= b->max_order && !IS_LIVE(b, index) &&
+			   index + (1UL << (order - b->min_order)) <= (unsigned long)b->nr_pages;
+		return fits ? 1L << order : -1;
+	}
+	if (order == b->min_order || value > order + 1)
+	{
+		return -1;
+	}
+
+	long left = check_node(b, 2 * node, order - 1);
+	long right = check_node(b, 2 * node + 1, order - 1);
+	uint8_t l = TREE(b)[2 * node];
+	uint8_t r = TREE(b)[2 * node + 1];
+	if (left < 0 || right < 0 || value != (l > r ? l : r))
+	{
+		return -1;
+	}
+	return left + right;
+}
+
+/**
+ * Check the lazily freed blocks, the free block counters and the tree
+ * @param b arena
+ * @return number of free bytes, or -1 if an invariant is broken
+ */
+static long check_arena(buddy_t *b)
+{
+	unsigned long cnt[BUDDY_NR_ORDERS] = { 0 };
+	long lazy_bytes = 0;
+
+	count_free(b, 1, b->top_order, cnt);
+	for (int o = b->min_order; o <= b->max_order; o++)
+	{
+		unsigned long n = 0;
+		for (unsigned long i = b->lazy[o]; i != 0; i = MARKS(b)[i - 1])
+		{
+			if (IS_LIVE(b, i - 1))
+			{
+				return -1;
+			}
+			n++;
+		}
+		if (n != b->lazy_count[o])
+		{
+			return -1;
+		}
+		cnt[o] += n;
+		lazy_bytes += (long)n << o;
+	}
+	if (memcmp(cnt, b->stats.free_blocks, sizeof(cnt)) != 0)
+	{
+		return -1;
+	}
+	long free_bytes = check_node(b, 1, b->top_order);
+	return free_bytes < 0 ? -1 : free_bytes + lazy_bytes;
+}
+
+/**
+ * Check the tree invariants of an arena
+ *
+ * Every free block must lie inside the arena and not be marked live, every
+ * inner node must hold the largest value of its children and the free block
+ * counters must match the tree plus the lazily freed blocks.
+ *
+ * @param b arena
+ * @return number of free bytes, or -1 if an invariant is broken
+ */
+long buddy_arena_check(buddy_t *b)
+{
+	BUDDY_LOCK(b);
+	long free_bytes = check_arena(b);
+	BUDDY_UNLOCK(b);
+	return free_bytes;
+}
+
+/**
+ * Write a whole buffer at an offset of a file
+ * @param fd file
+ * @param buf data
+ * @param len bytes to write
+ * @param off file offset
+ * @return 0, or -1 with errno set
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/**
+ * Write an arena to a file for buddy_arena_restore()
+ *
+ * The file gets the layout of a shared arena: the header with the tree
+ * behind it, then the memory on a page boundary. Nothing in it is a
+ * pointer, so it can be mapped back anywhere as it is. Anything the file
+ * held before is replaced.
+ *
+ * @param b arena
+ * @param fd regular file open for writing
+ * @return 0, or -1 with errno set
+ */
+int buddy_arena_snapshot(buddy_t *b, int fd)
+{
+	unsigned long nr_pages;
+	size_t meta_size;
+	if (arena_geometry(b->size, b->min_order, &nr_pages, &meta_size) != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t memory_off = (meta_size + page_size - 1) & ~(page_size - 1);
+	size_t image_len = memory_off + b->size;
+
+	buddy_t hdr;
+	BUDDY_LOCK(b);
+	/* the lock is copied too, restore sets it up anew */
+	hdr = *b;
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.memory_off = memory_off;
+	hdr.map_len = 0;
+	hdr.image_len = image_len;
+	hdr.shared = 0;
+
+	int ret = ftruncate(fd, 0) == 0 && ftruncate(fd, image_len) == 0 &&
+		  pwrite_all(fd, &hdr, sizeof(hdr), 0) == 0 &&
+		  pwrite_all(fd, b + 1, meta_size - sizeof(hdr), sizeof(hdr)) == 0 &&
+		  pwrite_all(fd, MEMORY(b), b->size, memory_off) == 0 ? 0 : -1;
+	BUDDY_UNLOCK(b);
+	return ret;
+}
+
+/**
+ * Map an arena written by buddy_arena_snapshot() back in
+ *
+ * The file is mapped copy-on-write and used as it is, with no pass over the
+ * tree: pages of the arena are read in as they are first touched, and the
+ * file itself is never changed. The memory is placed as strictly aligned as
+ * in the arena that was written. Blocks keep their offsets, see
+ * buddy_offset(). The snapshot must come from the same build of the
+ * allocator. buddy_destroy() unmaps the arena.
+ *
+ * @param fd snapshot file open for reading
+ * @return the arena, or NULL if the file does not hold a snapshot or cannot
+ * be mapped, with errno set
+ */
+buddy_t *buddy_arena_restore(int fd)
+{
+	buddy_t hdr;
+	struct stat st;
+	unsigned long nr_pages;
+	size_t meta_size;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t memory_off = 0;
+
+	/* the header must describe exactly the image this build would write */
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(hdr) &&
+	    pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+	    hdr.magic == SNAPSHOT_MAGIC &&
+	    arena_geometry(hdr.size, hdr.min_order, &nr_pages, &meta_size) == 0 &&
+	    nr_pages == hdr.nr_pages && ((size_t)nr_pages << hdr.min_order) == hdr.size &&
+	    hdr.align_order >= 0 && hdr.align_order <= hdr.max_order)
+	{
+		memory_off = (meta_size + page_size - 1) & ~(page_size - 1);
+	}
+	if (memory_off == 0 || hdr.memory_off != memory_off ||
+	    hdr.image_len != memory_off + hdr.size || hdr.image_len != (size_t)st.st_size)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* reserve room to align the memory, then map the file over it */
+	size_t image_len = hdr.image_len;
+	size_t align = 1UL << hdr.align_order;
+	if (align < page_size)
+	{
+		align = page_size;
+	}
+	char *map = mmap(NULL, image_len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+	char *base = (char *)((((uintptr_t)map + memory_off + align - 1) & ~(align - 1)) - memory_off);
+	if (mmap(base, image_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		int err = errno;
+		munmap(map, image_len + align);
+		errno = err;
+		return NULL;
+	}
+	if (base > map)
+	{
+		munmap(map, base - map);
+	}
+	if (map + image_len + align > base + image_len)
+	{
+		munmap(base + image_len, map + image_len + align - (base + image_len));
+	}
+
+	buddy_t *b = (buddy_t *)base;
+	b->magic = 0;
+	pthread_mutex_init(&b->lock, NULL);
+	return b;
+}
+
+/**
+ * Write the default arena to a file, see buddy_arena_snapshot()
+ *
+ * @param fd regular file open for writing
+ * @return 0, or -1 with errno set
+ */
+int buddy_snapshot(int fd)
+{
+	return buddy_arena_snapshot(g_buddy, fd);
+}
+
+/**
+ * Replace the default arena with a snapshot, see buddy_arena_restore()
+ *
+ * The restored arena lives in the mapping of the file rather than in
+ * g_memory; buddy_init() goes back to a fresh arena over g_memory.
+ *
+ * @param fd snapshot file open for reading
+ * @return 0, or -1 with errno set and the default arena left alone
+ */
+int buddy_restore(int fd)
+{
+	buddy_t *b = buddy_arena_restore(fd);
+	if (b == NULL)
+	{
+		return -1;
+	}
+	buddy_destroy(g_buddy);
+	g_buddy = b;
+	return 0;
+}
@@ -0,0 +1,246 @@
+/**
+ * Synthetic workload generator
+ *
+ * Writes an allocation trace for replay: a simulator script with numbered
+ * variables, or with -b a binary trace (see trace.h). Every step allocates
+ * or frees one block so that the number of live blocks follows the live set
+ * shape, and once the steps are done every block still live is freed.
+ *
+ * Usage: ./gen_trace [-n ops] [-s sizes] [-f order] [-l live] [-r seed] [-b] [-o out]
+ *   -n  number of steps, default 1000000
+ *   -s  block sizes, default uniform:16:65536
+ *         uniform:MIN:MAX            every size in [MIN, MAX] alike
+ *         powerlaw:MIN:MAX:ALPHA     size x with density ~ x^-(ALPHA + 1)
+ *         bimodal:SMALL:LARGE:PCT    PCT percent in [SMALL/2, SMALL], the
+ *                                    rest in [LARGE/2, LARGE]
+ *  -f  which live block a free takes: lifo, fifo or random, default random
+ *  -l  live set: steady:N holds about N blocks, ramp:N grows to N over the
+ *      trace, default steady:10000
+ *  -r  random seed, default 1
+ *  -b  write a binary trace
+ *  -o  output file, default standard output
+ */
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+enum dist { UNIFORM, POWERLAW, BIMODAL };
+enum order { LIFO, FIFO, RANDOM };
+
+static enum dist dist = UNIFORM;
+static double size_a = 16, size_b = 65536, size_c = 0;
+static enum order free_order = RANDOM;
+static int ramp = 0;
+static uint32_t target = 10000;
+static uint64_t rng = 1;
+
+static FILE *out;
+static int binary = 0;
+static uint64_t nr_ops = 0;
+static uint32_t nr_vars = 0;
+
+/* xorshift64*, so a seed gives the same trace everywhere */
+static uint64_t next_random()
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+/* uniform in [0, 1) */
+static double uniform()
+{
+	return (next_random() >> 11) * 0x1.0p-53;
+}
+
+/* uniform integer in [lo, hi] */
+static uint64_t uniform_int(double lo, double hi)
+{
+	return (uint64_t)(lo + uniform() * (hi - lo + 1));
+}
+
+static uint64_t next_size()
+{
+	switch (dist) {
+	case POWERLAW: {
+		/* inverse CDF of the Pareto distribution bounded to [a, b] */
+		double la = pow(size_a, size_c), hb = pow(size_b, size_c);
+		double u = uniform();
+		return (uint64_t)pow(-(u * hb - u * la - hb) / (hb * la), -1.0 / size_c);
+	}
+	case BIMODAL:
+		if (uniform() * 100 < size_c)
+			return uniform_int(size_a / 2, size_a);
+		return uniform_int(size_b / 2, size_b);
+	default:
+		return uniform_int(size_a, size_b);
+	}
+}
+
+static void emit(uint8_t opcode, uint32_t var, uint64_t size)
+{
+	nr_ops++;
+	if (binary) {
+		struct trace_op op = { .op = opcode, .size = size, .var = var };
+		fwrite(&op, sizeof(op), 1, out);
+	} else if (opcode == TRACE_ALLOC) {
+		fprintf(out, "%u=alloc(%" PRIu64 ")\n", var, size);
+	} else {
+		fprintf(out, "free(%u)\n", var);
+	}
+}
+
+static int parse_args(int argc, char **argv, uint64_t *steps, const char **path)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:f:l:r:bo:")) != -1) {
+		switch (opt) {
+		case 'n':
+			*steps = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			if (sscanf(optarg, "uniform:%lf:%lf", &size_a, &size_b) == 2)
+				dist = UNIFORM;
+			else if (sscanf(optarg, "powerlaw:%lf:%lf:%lf", &size_a, &size_b, &size_c) == 3)
+				dist = POWERLAW;
+			else if (sscanf(optarg, "bimodal:%lf:%lf:%lf", &size_a, &size_b, &size_c) == 3)
+				dist = BIMODAL;
+			else
+				return -1;
+			if (size_a < 1 || size_b < size_a || (dist == POWERLAW && size_c <= 0))
+				return -1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "lifo") == 0)
+				free_order = LIFO;
+			else if (strcmp(optarg, "fifo") == 0)
+				free_order = FIFO;
+			else if (strcmp(optarg, "random") == 0)
+				free_order = RANDOM;
+			else
+				return -1;
+			break;
+		case 'l':
+			if (sscanf(optarg, "steady:%u", &target) == 1)
+				ramp = 0;
+			else if (sscanf(optarg, "ramp:%u", &target) == 1)
+				ramp = 1;
+			else
+				return -1;
+			if (target == 0)
+				return -1;
+			break;
+		case 'r':
+			rng = strtoull(optarg, NULL, 10) | 1;
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		case 'o':
+			*path = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return optind == argc ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t steps = 1000000;
+	const char *path = NULL;
+
+	if (parse_args(argc, argv, &steps, &path) != 0) {
+		fprintf(stderr, "Usage: %s [-n ops] [-s uniform:MIN:MAX|powerlaw:MIN:MAX:ALPHA|"
+			"bimodal:SMALL:LARGE:PCT] [-f lifo|fifo|random] [-l steady:N|ramp:N] "
+			"[-r seed] [-b] [-o out]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	out = path ? fopen(path, "wb") : stdout;
+	if (out == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	/* live variables in a ring, oldest at head, and the numbers free for reuse */
+	uint32_t cap = 1;
+	while (cap <= target)
+		cap *= 2;
+	uint32_t *live = malloc(cap * sizeof(*live));
+	uint32_t *spare = malloc(cap * sizeof(*spare));
+	uint32_t head = 0, count = 0, nr_spare = 0;
+
+	if (live == NULL || spare == NULL) {
+		perror("gen_trace");
+		return EXIT_FAILURE;
+	}
+
+	/* room for the header, filled in at the end */
+	struct trace_header h;
+	memset(&h, 0, sizeof(h));
+	if (binary)
+		fwrite(&h, sizeof(h), 1, out);
+
+	for (uint64_t i = 0; i < steps; i++) {
+		double goal = ramp ? (double)target * (i + 1) / steps : target;
+		/* certain to allocate when empty, even odds at the goal */
+		int alloc = count == 0 || (count < goal && uniform() < 1 - 0.5 * count / goal);
+
+		if (alloc && count < cap - 1) {
+			uint32_t var = nr_spare ? spare[--nr_spare] : nr_vars++;
+			live[(head + count++) & (cap - 1)] = var;
+			emit(TRACE_ALLOC, var, next_size());
+			continue;
+		}
+
+		uint32_t slot;
+		switch (free_order) {
+		case LIFO:
+			slot = count - 1;
+			break;
+		case FIFO:
+			slot = 0;
+			break;
+		default:
+			slot = next_random() % count;
+		}
+		uint32_t var = live[(head + slot) & (cap - 1)];
+		if (slot == 0) {
+			head = (head + 1) & (cap - 1);
+		} else {
+			/* the newest block takes the place of the freed one */
+			live[(head + slot) & (cap - 1)] = live[(head + count - 1) & (cap - 1)];
+		}
+		count--;
+		spare[nr_spare++] = var;
+		emit(TRACE_FREE, var, 0);
+	}
+	while (count > 0) {
+		emit(TRACE_FREE, live[head], 0);
+		head = (head + 1) & (cap - 1);
+		count--;
+	}
+
+	if (binary) {
+		memcpy(h.magic, TRACE_MAGIC, 8);
+		h.nr_ops = nr_ops;
+		h.nr_vars = nr_vars;
+		if (fseek(out, 0, SEEK_SET) != 0) {
+			fprintf(stderr, "%s: binary traces need a seekable output\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		fwrite(&h, sizeof(h), 1, out);
+	}
+	free(live);
+	free(spare);
+	return fclose(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,451 @@
+/**
+ * NUMA Front End
+ *
+ * Every node gets an arena of its own on a mapping bound to that node with
+ * mbind(), so a block is backed by the node it was handed out from. An
+ * allocation goes to the arena of the calling thread's node and only falls
+ * back to the other nodes, nearest first by the distances the kernel reports,
+ * when that arena is exhausted. A free finds the owning arena from the
+ * address.
+ *
+ * Nodes the machine does not have are simulated: their arenas are mapped but
+ * not bound, and threads are spread over them by CPU, so the routing can be
+ * exercised on a single node box; their distance is taken from the
+ * difference in index. buddy_numa_set_node() pins a thread to a node
+ * explicitly.
+ *
+ * The arenas are shared by all threads of a node, so the front end is only
+ * thread safe when the allocator is built with USE_THREADS or USE_LOCKFREE.
+ */
+
+
+/**************************************************************************
+ * Included Files
+ **************************************************************************/
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+
+/**************************************************************************
+ * Public Definitions
+ **************************************************************************/
+
+/* most nodes a front end serves */
+#define MAX_NODES 64
+
+/* distance of a node to itself in the kernel's tables, and the step per
+ * index between simulated nodes */
+#define LOCAL_DISTANCE 10
+
+/**************************************************************************
+ * Public Types
+ **************************************************************************/
+
+/**
+ * Arena of one node
+ */
+struct numa_node {
+	buddy_t *arena;               ///< arena on memory bound to the node
+	int bound;                    ///< 1 if mbind() bound the memory, 0 if simulated or refused
+	char *start;                  ///< first byte of the arena
+	char *end;                    ///< byte past the arena
+	unsigned long local_allocs;   ///< blocks handed to threads of this node
+	unsigned long remote_allocs;  ///< blocks handed to threads of other nodes
+};
+
+/**
+ * NUMA front end
+ */
+struct buddy_numa {
+	int nr_nodes;                 ///< number of arenas
+	int nr_real;                  ///< nodes the machine has, the rest are simulated
+	int flags;                    ///< BUDDY_NUMA_* flags
+	unsigned long next;           ///< next node of interleaved allocations
+	struct numa_node nodes[MAX_NODES];
+	uint8_t fallback[MAX_NODES][MAX_NODES];  ///< per home node, every node nearest first
+
+};
+
+/**************************************************************************
+ * Global Variables
+ **************************************************************************/
+
+/* node the calling thread was pinned to, or -1 to follow its CPU */
+static __thread int pinned_node = -1;
+
+/* CPU and node of the calling thread when first asked, -1 before that */
+static __thread int home_cpu = -1;
+static __thread int home_node = -1;
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/**
+ * Count the memory nodes of the machine
+ * @return number of nodes, at least 1
+ */
+static int numa_real_nodes()
+{
+	char path[64];
+	int nr = 0;
+
+	do
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nr);
+	} while (access(path, F_OK) == 0 && ++nr < MAX_NODES);
+	return nr > 0 ? nr : 1;
+}
+
+/**
+ * Read the distances of a node to the others from sysfs
+ * @param node node the distances are from
+ * @param nr_nodes number of distances to read
+ * @param distance receives the distance of every node, left alone past what
+ * the kernel reports
+ */
+static void numa_read_distances(int node, int nr_nodes, int *distance)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", node);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < nr_nodes && fscanf(f, "%d", &distance[i]) == 1; i++)
+	{
+	}
+	fclose(f);
+}
+
+/**
+ * Rank the nodes by distance from every home node, for the fallback of
+ * buddy_numa_alloc()
+ *
+ * Nodes the machine has are ranked by the distances the kernel reports.
+ * Simulated nodes have none, so their distance grows by LOCAL_DISTANCE per
+ * index, the same step as between neighbours in a typical table. Nodes at the
+ * same distance are ranked by index distance, the lower one first.
+ *
+ * @param n front end with nr_nodes and nr_real set
+ */
+static void numa_rank_nodes(buddy_numa_t *n)
+{
+	for (int home = 0; home < n->nr_nodes; home++)
+	{
+		int distance[MAX_NODES];
+		int rank = 0;
+
+		for (int i = 0; i < n->nr_nodes; i++)
+		{
+			distance[i] = LOCAL_DISTANCE * (1 + abs(i - home));
+		}
+		if (home < n->nr_real)
+		{
+			numa_read_distances(home, n->nr_real < n->nr_nodes ? n->nr_real : n->nr_nodes, distance);
+		}
+
+		/* the simulated tables are tiny, an insertion sort does */
+		for (int i = 0; i < n->nr_nodes; i++)
+		{
+			int j = rank++;
+
+			while (j > 0)
+			{
+				int prev = n->fallback[home][j - 1];
+				int d = distance[prev] - distance[i];
+				if (d == 0)
+				{
+					d = abs(prev - home) - abs(i - home);
+				}
+				if (d <= 0)
+				{
+					break;
+				}
+				n->fallback[home][j] = prev;
+				j--;
+			}
+			n->fallback[home][j] = i;
+		}
+	}
+}
+
+/**
+ * Bind a range of memory to a node
+ * @param mem start of the range
+ * @param len length of the range
+ * @param node node the pages must come from
+ * @return 0 on success, -1 if the kernel refused
+ */
+static int numa_bind(void *mem, size_t len, int node)
+{
+	unsigned long mask = 1UL << node;
+
+	return syscall(SYS_mbind, mem, len, MPOL_BIND, &mask, sizeof(mask) * CHAR_BIT, 0) == 0 ? 0 : -1;
+}
+
+/**
+ * Hand out a block from one node
+ * @param n front end
+ * @param node node to allocate from
+ * @param home node of the calling thread
+ * @param size size in bytes
+ * @return block address, or NULL if the node is exhausted
+ */
+static void *numa_alloc_on(buddy_numa_t *n, int node, int home, size_t size)
+{
+	void *addr = buddy_arena_alloc(n->nodes[node].arena, size);
+
+	if (addr != NULL)
+	{
+		if (node == home)
+		{
+			__atomic_add_fetch(&n->nodes[node].local_allocs, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			__atomic_add_fetch(&n->nodes[node].remote_allocs, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return addr;
+}
+
+/**************************************************************************
+ * Public Functions
+ **************************************************************************/
+
+/**
+ * Create one arena per node
+ *
+ * Every arena sits on an anonymous mapping of node_len bytes that commits
+ * pages only when they are touched. Mappings of nodes the machine has are
+ * bound to them with MPOL_BIND before any page is touched; if the kernel
+ * refuses, the node goes on unbound and buddy_numa_stats() reports it.
+ *
+ * @param nr_nodes number of nodes, 0 for the nodes of the machine; more than
+ * the machine has are simulated
+ * @param node_len arena size of each node in bytes
+ * @param min_order order of the smallest block handed out
+ * @param flags BUDDY_NUMA_INTERLEAVE to ignore the thread's node
+ * @return the front end, or NULL if the arguments are unusable or an arena
+ * could not be created
+ */
+buddy_numa_t *buddy_numa_create(int nr_nodes, size_t node_len, int min_order, int flags)
+{
+	int nr_real = numa_real_nodes();
+
+	if (nr_nodes == 0)
+	{
+		nr_nodes = nr_real;
+	}
+	if (nr_nodes < 1 || nr_nodes > MAX_NODES)
+	{
+		return NULL;
+	}
+
+	buddy_numa_t *n = calloc(1, sizeof(*n));
+	if (n == NULL)
+	{
+		return NULL;
+	}
+	n->nr_nodes = nr_nodes;
+	n->nr_real = nr_real;
+	n->flags = flags;
+	numa_rank_nodes(n);
+
+	for (int i = 0; i < nr_nodes; i++)
+	{
+		struct numa_node *node = &n->nodes[i];
+
+		char *mem = mmap(NULL, node_len, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED)
+		{
+			buddy_numa_destroy(n);
+			return NULL;
+		}
+		node->start = mem;
+		node->end = mem + node_len;
+		/* an arena the kernel refuses to bind is left unbound like a
+		 * simulated one, and buddy_numa_stats() says so */
+		node->bound = i < nr_real && numa_bind(mem, node_len, i) == 0;
+
+		node->arena = buddy_create(mem, node_len, min_order);
+		if (node->arena == NULL)
+		{
+			buddy_numa_destroy(n);
+			return NULL;
+		}
+	}
+	return n;
+}
+
+/**
+ * Release every arena of a front end
+ * @param n front end, may be NULL
+ */
+void buddy_numa_destroy(buddy_numa_t *n)
+{
+	if (n == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < n->nr_nodes; i++)
+	{
+		buddy_destroy(n->nodes[i].arena);
+		if (n->nodes[i].start != NULL)
+		{
+			munmap(n->nodes[i].start, n->nodes[i].end - n->nodes[i].start);
+		}
+	}
+	free(n);
+}
+
+/**
+ * Pin the calling thread to a node
+ * @param node node the thread allocates from, or -1 to follow the CPU it
+ * runs on
+ */
+void buddy_numa_set_node(int node)
+{
+	pinned_node = node;
+	home_cpu = -1;
+	home_node = -1;
+}
+
+/**
+ * Node of the calling thread
+ *
+ * The CPU is looked up once per thread. On simulated nodes threads are
+ * spread over the nodes by CPU number.
+ *
+ * @param n front end
+ * @return node the thread allocates from first
+ */
+int buddy_numa_node(buddy_numa_t *n)
+{
+	if (pinned_node >= 0)
+	{
+		return pinned_node % n->nr_nodes;
+	}
+	if (home_cpu < 0)
+	{
+		unsigned int cpu, node;
+
+		if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		{
+			cpu = node = 0;
+		}
+		home_cpu = cpu;
+		home_node = node;
+	}
+	if (n->nr_nodes > n->nr_real)
+	{
+		return home_cpu % n->nr_nodes;
+	}
+	return home_node % n->nr_nodes;
+}
+
+/**
+ * Find the node a block belongs to
+ * @param n front end
+ * @param addr block address
+ * @return node of the arena holding addr, or -1 if no arena does
+ */
+int buddy_numa_node_of(buddy_numa_t *n, void *addr)
+{
+	for (int i = 0; i < n->nr_nodes; i++)
+	{
+		if ((char *)addr >= n->nodes[i].start && (char *)addr < n->nodes[i].end)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Allocate a block, preferably on the calling thread's node
+ *
+ * When the thread's node is exhausted the other nodes are tried nearest
+ * first, see numa_rank_nodes().
+ * With BUDDY_NUMA_INTERLEAVE every allocation starts at the next node in
+ * turn instead and goes on round the nodes from there.
+ *
+ * @param n front end
+ * @param size size in bytes
+ * @return block address, or NULL if every node is exhausted
+ */
+void *buddy_numa_alloc(buddy_numa_t *n, size_t size)
+{
+	int home = buddy_numa_node(n);
+
+	if (n->flags & BUDDY_NUMA_INTERLEAVE)
+	{
+		int first = __atomic_fetch_add(&n->next, 1, __ATOMIC_RELAXED) % n->nr_nodes;
+
+		for (int i = 0; i < n->nr_nodes; i++)
+		{
+			void *addr = numa_alloc_on(n, (first + i) % n->nr_nodes, home, size);
+			if (addr != NULL)
+			{
+				return addr;
+			}
+		}
+		return NULL;
+	}
+	for (int i = 0; i < n->nr_nodes; i++)
+	{
+		void *addr = numa_alloc_on(n, n->fallback[home][i], home, size);
+		if (addr != NULL)
+		{
+			return addr;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Free a block to the arena it came from
+ * @param n front end
+ * @param addr block address returned by buddy_numa_alloc(), may be NULL
+ * @return 0, or -1 if addr lies outside every node's arena or is not a live
+ * block of its arena, see buddy_arena_free()
+ */
+int buddy_numa_free(buddy_numa_t *n, void *addr)
+{
+	if (addr == NULL)
+	{
+		return 0;
+	}
+	int node = buddy_numa_node_of(n, addr);
+
+	if (node < 0)
+	{
+		return -1;
+	}
+	return buddy_arena_free(n->nodes[node].arena, addr);
+}
+
+/**
+ * Read the statistics of one node
+ * @param n front end
+ * @param node node index
+ * @param st filled with the node's statistics
+ */
+void buddy_numa_stats(buddy_numa_t *n, int node, buddy_numa_stats_t *st)
+{
+	buddy_arena_stats(n->nodes[node].arena, &st->arena);
+	st->local_allocs = __atomic_load_n(&n->nodes[node].local_allocs, __ATOMIC_RELAXED);
+	st->remote_allocs = __atomic_load_n(&n->nodes[node].remote_allocs, __ATOMIC_RELAXED);
+	st->bound = n->nodes[node].bound;
+}
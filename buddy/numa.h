@@ -0,0 +1,34 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "buddy.h"
+
+/* flags of buddy_numa_create() */
+#define BUDDY_NUMA_INTERLEAVE 1   ///< spread allocations over all nodes in turn
+
+/**
+ * Per-node statistics of a NUMA front end
+ */
+typedef struct {
+	buddy_stats_t arena;          ///< statistics of the node's arena
+	unsigned long local_allocs;   ///< blocks handed to threads of this node
+	unsigned long remote_allocs;  ///< blocks handed to threads of other nodes
+	int bound;                    ///< 1 if the node's memory is bound to it, 0 if the node is simulated or mbind() failed
+} buddy_numa_stats_t;
+
+/**
+ * One buddy arena per NUMA node, with allocations served from the node of
+ * the calling thread
+ */
+typedef struct buddy_numa buddy_numa_t;
+
+buddy_numa_t *buddy_numa_create(int nr_nodes, size_t node_len, int min_order, int flags);
+void buddy_numa_destroy(buddy_numa_t *n);
+void buddy_numa_set_node(int node);
+int buddy_numa_node(buddy_numa_t *n);
+int buddy_numa_node_of(buddy_numa_t *n, void *addr);
+void *buddy_numa_alloc(buddy_numa_t *n, size_t size);
+int buddy_numa_free(buddy_numa_t *n, void *addr);
+void buddy_numa_stats(buddy_numa_t *n, int node, buddy_numa_stats_t *st);
+
+#endif // NUMA_H
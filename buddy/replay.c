@@ -0,0 +1,636 @@
+/**
+ * Trace replay benchmark
+ *
+ * Replays an allocation trace against a fresh arena without any dumps. A
+ * trace is either a simulator script or a binary trace (see trace.h). Scripts
+ * may name their variables with numbers as well as letters, a letter being the
+ * variable of its character code, so a trace can hold millions of live
+ * objects.
+ *
+ * The trace is replayed twice. The first run times every operation on its
+ * own for latency histograms per operation and block order, the second is
+ * timed as a whole for the average cost of an operation. Failed allocations
+ * are counted and the trace goes on without the variable.
+ *
+ * Usage: ./replay [-a buddy|malloc] [-m arena_mib] [-p min_order] [-l watermark]
+ *                 [-o out] [-c] [-H] trace
+ *   -a  allocator to replay against, default buddy; malloc is the baseline
+ *   -m  arena size in MiB, default 1024, committed only as it is touched
+ *   -p  order of the smallest block, default 12
+ *   -l  lazy coalescing watermark, default 0
+ *   -o  write the trace in binary form to out instead of replaying it
+ *   -c  print only a CSV row of trace,allocator and the summary
+ *   -H  print every histogram bucket as well
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "buddy.h"
+#include "trace.h"
+
+/* histogram buckets, bucket k counts latencies below 2^(k+1) ns */
+#define NR_BUCKETS 40
+
+/* orders of the histograms */
+#define NR_ORDERS 64
+
+static const char *op_names[TRACE_NR_OPS] = { "alloc", "realloc", "free" };
+
+/**
+ * A trace in memory
+ */
+struct trace {
+	struct trace_op *ops;   ///< the operations
+	uint64_t nr_ops;        ///< number of operations
+	uint32_t nr_vars;       ///< one more than the highest variable number
+	size_t capacity;        ///< room in ops, 0 if ops is a mapping of the file
+};
+
+/**
+ * Outcome of one replay
+ */
+struct result {
+	double ns;                      ///< wall time of the whole replay
+	unsigned long failed;           ///< allocations and reallocations that failed
+	size_t peak_bytes;              ///< peak of the arena's allocated bytes
+	unsigned long count[TRACE_NR_OPS][NR_ORDERS];
+	double total_ns[TRACE_NR_OPS][NR_ORDERS];
+	unsigned long max_ns[TRACE_NR_OPS][NR_ORDERS];
+	unsigned long hist[TRACE_NR_OPS][NR_ORDERS][NR_BUCKETS];
+};
+
+/**
+ * Allocator a trace is replayed against
+ */
+struct allocator {
+	const char *name;
+	void (*setup)(void);
+	void *(*alloc)(size_t size);
+	void *(*realloc)(void *addr, size_t size);
+	void (*free)(void *addr);
+	size_t (*peak_bytes)(void);   ///< most bytes held in blocks at once
+	void (*teardown)(void);
+};
+
+static size_t arena_size = 1024UL << 20;
+static int min_order = 12;
+static int lazy = 0;
+static struct result timed;
+
+/* arena of the buddy allocator under test */
+static buddy_t *arena;
+
+/* bytes held in malloc blocks and their peak, followed only while track is set */
+static size_t malloc_bytes;
+static size_t malloc_peak;
+static int track;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* order of the block that holds size bytes */
+static int size_order(size_t size)
+{
+	int order = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+	return order < min_order ? min_order : order;
+}
+
+static void buddy_setup()
+{
+	arena = buddy_create_mapped(arena_size, min_order, -1, 0);
+	if (arena == NULL) {
+		fprintf(stderr, "replay: cannot set up a %zu MiB arena\n", arena_size >> 20);
+		exit(EXIT_FAILURE);
+	}
+	buddy_arena_set_lazy(arena, lazy);
+}
+
+static void *buddy_op_alloc(size_t size)
+{
+	return buddy_arena_alloc(arena, size);
+}
+
+static void *buddy_op_realloc(void *addr, size_t size)
+{
+	return buddy_arena_realloc(arena, addr, size);
+}
+
+static void buddy_op_free(void *addr)
+{
+	buddy_arena_free(arena, addr);
+}
+
+static size_t buddy_peak_bytes()
+{
+	buddy_stats_t st;
+
+	buddy_arena_stats(arena, &st);
+	return st.peak_bytes_allocated;
+}
+
+static void buddy_teardown()
+{
+	buddy_destroy(arena);
+	arena = NULL;
+}
+
+static void malloc_setup()
+{
+	malloc_bytes = 0;
+	malloc_peak = 0;
+}
+
+/* follow the bytes held in malloc blocks */
+static void malloc_account(void *old, void *addr)
+{
+	if (!track)
+		return;
+	if (old != NULL)
+		malloc_bytes -= malloc_usable_size(old);
+	if (addr != NULL)
+		malloc_bytes += malloc_usable_size(addr);
+	if (malloc_bytes > malloc_peak)
+		malloc_peak = malloc_bytes;
+}
+
+static void *malloc_op_alloc(size_t size)
+{
+	void *addr = malloc(size);
+
+	malloc_account(NULL, addr);
+	return addr;
+}
+
+static void *malloc_op_realloc(void *addr, size_t size)
+{
+	size_t old = track ? malloc_usable_size(addr) : 0;
+	void *mem = realloc(addr, size);
+
+	if (track && (mem != NULL || size == 0)) {
+		malloc_bytes -= old;
+		malloc_account(NULL, mem);
+	}
+	return mem;
+}
+
+static void malloc_op_free(void *addr)
+{
+	malloc_account(addr, NULL);
+	free(addr);
+}
+
+static size_t malloc_peak_bytes()
+{
+	return malloc_peak;
+}
+
+static void malloc_teardown()
+{
+}
+
+static const struct allocator allocators[] = {
+	{ "buddy", buddy_setup, buddy_op_alloc, buddy_op_realloc, buddy_op_free,
+	  buddy_peak_bytes, buddy_teardown },
+	{ "malloc", malloc_setup, malloc_op_alloc, malloc_op_realloc, malloc_op_free,
+	  malloc_peak_bytes, malloc_teardown },
+};
+
+static const struct allocator *allocator = &allocators[0];
+
+/**
+ * Read a variable name, a number or a single letter
+ * @param p cursor, moved past the name
+ * @param var receives the variable number
+ * @return 0, or -1 if there is no name at the cursor
+ */
+static int parse_var(const char **p, uint32_t *var)
+{
+	char *end;
+
+	if ((**p >= 'a' && **p <= 'z') || (**p >= 'A' && **p <= 'Z')) {
+		*var = (unsigned char)*(*p)++;
+		return 0;
+	}
+	*var = strtoul(*p, &end, 10);
+	if (end == *p)
+		return -1;
+	*p = end;
+	return 0;
+}
+
+/**
+ * Read a size in bytes, with an optional K suffix
+ * @param p cursor, moved past the size
+ * @param size receives the size
+ * @return 0, or -1 if there is no size at the cursor
+ */
+static int parse_size(const char **p, uint64_t *size)
+{
+	char *end;
+
+	*size = strtoull(*p, &end, 10);
+	if (end == *p)
+		return -1;
+	if (*end == 'k' || *end == 'K') {
+		*size *= 1024;
+		end++;
+	}
+	*p = end;
+	return 0;
+}
+
+/* skip a literal, return 0 if it was there */
+static int parse_lit(const char **p, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	if (strncmp(*p, lit, len) != 0)
+		return -1;
+	*p += len;
+	return 0;
+}
+
+/**
+ * Parse one command of a script, with the whitespace already removed
+ * @param cmd the command
+ * @param op receives the operation
+ * @return 0, or -1 if the command cannot be parsed
+ */
+static int parse_op(const char *cmd, struct trace_op *op)
+{
+	const char *p = cmd;
+
+	memset(op, 0, sizeof(*op));
+	if (parse_lit(&p, "free(") == 0) {
+		op->op = TRACE_FREE;
+		return parse_var(&p, &op->var) || parse_lit(&p, ")") || *p ? -1 : 0;
+	}
+	if (parse_var(&p, &op->var) || parse_lit(&p, "="))
+		return -1;
+	if (parse_lit(&p, "realloc(") == 0) {
+		op->op = TRACE_REALLOC;
+		if (parse_var(&p, &op->src) || parse_lit(&p, ","))
+			return -1;
+	} else if (parse_lit(&p, "alloc(") == 0) {
+		op->op = TRACE_ALLOC;
+	} else {
+		return -1;
+	}
+	return parse_size(&p, &op->size) || parse_lit(&p, ")") || *p ? -1 : 0;
+}
+
+/**
+ * Parse a simulator script
+ * @param f the script
+ * @param t receives the operations
+ * @return 0, or -1 on a parse error, which is reported
+ */
+static int load_script(FILE *f, struct trace *t)
+{
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	int linenum = 0;
+
+	while ((read = getline(&line, &len, f)) > 0) {
+		int n = 0;
+
+		linenum++;
+		for (ssize_t i = 0; i < read; i++)
+			if (line[i] != ' ' && line[i] != '\t' && line[i] != '\n' && line[i] != '\r')
+				line[n++] = line[i];
+		line[n] = '\0';
+		if (n == 0)
+			continue;
+
+		if (t->nr_ops == t->capacity) {
+			t->capacity = t->capacity ? 2 * t->capacity : 4096;
+			t->ops = realloc(t->ops, t->capacity * sizeof(*t->ops));
+			if (t->ops == NULL) {
+				perror("replay");
+				exit(EXIT_FAILURE);
+			}
+		}
+		struct trace_op *op = &t->ops[t->nr_ops];
+		if (parse_op(line, op) != 0) {
+			fprintf(stderr, "line %d: cannot parse %s\n", linenum, line);
+			free(line);
+			return -1;
+		}
+		if (op->var >= t->nr_vars)
+			t->nr_vars = op->var + 1;
+		if (op->op == TRACE_REALLOC && op->src >= t->nr_vars)
+			t->nr_vars = op->src + 1;
+		t->nr_ops++;
+	}
+	free(line);
+	return 0;
+}
+
+/**
+ * Load a trace, binary traces are mapped
+ * @param path file name
+ * @param t receives the trace
+ * @return 0, or -1 if the file cannot be read
+ */
+static int load_trace(const char *path, struct trace *t)
+{
+	struct trace_header h;
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	memset(t, 0, sizeof(*t));
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		return -1;
+	}
+	if (read(fd, &h, sizeof(h)) == sizeof(h) && memcmp(h.magic, TRACE_MAGIC, 8) == 0) {
+		if ((size_t)st.st_size != sizeof(h) + h.nr_ops * sizeof(struct trace_op)) {
+			fprintf(stderr, "%s: truncated trace\n", path);
+			close(fd);
+			return -1;
+		}
+		char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			perror(path);
+			return -1;
+		}
+		t->ops = (struct trace_op *)(map + sizeof(h));
+		t->nr_ops = h.nr_ops;
+		t->nr_vars = h.nr_vars;
+		for (uint64_t i = 0; i < t->nr_ops; i++) {
+			struct trace_op *op = &t->ops[i];
+			if (op->op >= TRACE_NR_OPS || op->var >= t->nr_vars ||
+			    (op->op == TRACE_REALLOC && op->src >= t->nr_vars)) {
+				fprintf(stderr, "%s: bad record %lu\n", path, (unsigned long)i);
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	FILE *f = fdopen(fd, "r");
+	int ret = load_script(f, t);
+	fclose(f);
+	return ret;
+}
+
+/* release a trace loaded by load_trace() */
+static void free_trace(struct trace *t)
+{
+	if (t->capacity != 0)
+		free(t->ops);
+	else if (t->ops != NULL)
+		munmap((char *)t->ops - sizeof(struct trace_header),
+		       sizeof(struct trace_header) + t->nr_ops * sizeof(struct trace_op));
+}
+
+/**
+ * Write a trace in binary form
+ * @return 0, or -1 if the file cannot be written
+ */
+static int save_trace(const char *path, struct trace *t)
+{
+	struct trace_header h = { .nr_ops = t->nr_ops, .nr_vars = t->nr_vars };
+	FILE *f = fopen(path, "wb");
+
+	memcpy(h.magic, TRACE_MAGIC, 8);
+	if (f == NULL || fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(t->ops, sizeof(*t->ops), t->nr_ops, f) != t->nr_ops) {
+		perror(path);
+		return -1;
+	}
+	return fclose(f);
+}
+
+/* cost of reading the clock, taken off every timed operation */
+static double clock_overhead()
+{
+	double best = 1e9;
+
+	for (int i = 0; i < 1000; i++) {
+		double t0 = now_ns();
+		double t1 = now_ns();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return best;
+}
+
+/**
+ * Replay a trace on a fresh allocator
+ * @param t the trace
+ * @param r receives the outcome
+ * @param per_op time every operation for the histograms, and follow the
+ * bytes held for allocators that do not count them
+ */
+static void replay(struct trace *t, struct result *r, int per_op)
+{
+	void **vars = calloc(t->nr_vars, sizeof(void *));
+	uint8_t *orders = calloc(t->nr_vars, 1);
+	double overhead = per_op ? clock_overhead() : 0;
+
+	if (vars == NULL || orders == NULL) {
+		perror("replay");
+		exit(EXIT_FAILURE);
+	}
+	track = per_op;
+	allocator->setup();
+
+	double start = now_ns();
+	for (uint64_t i = 0; i < t->nr_ops; i++) {
+		struct trace_op *op = &t->ops[i];
+		double t0 = per_op ? now_ns() : 0;
+		int order;
+
+		switch (op->op) {
+		case TRACE_ALLOC:
+			vars[op->var] = allocator->alloc(op->size);
+			order = orders[op->var] = size_order(op->size);
+			r->failed += vars[op->var] == NULL;
+			break;
+		case TRACE_REALLOC:
+			order = size_order(op->size);
+			if (vars[op->src] == NULL) {
+				/* its allocation failed, go on without it */
+				continue;
+			}
+			void *mem = allocator->realloc(vars[op->src], op->size);
+			if (mem == NULL) {
+				/* a size of 0 frees the block */
+				if (op->size == 0)
+					vars[op->src] = NULL;
+				else
+					r->failed++;
+				break;
+			}
+			vars[op->src] = NULL;
+			vars[op->var] = mem;
+			orders[op->var] = order;
+			break;
+		default:
+			if (vars[op->var] == NULL)
+				continue;
+			order = orders[op->var];
+			allocator->free(vars[op->var]);
+			vars[op->var] = NULL;
+			break;
+		}
+
+		if (per_op) {
+			double ns = now_ns() - t0 - overhead;
+			unsigned long lat = ns > 0 ? (unsigned long)ns : 0;
+			int bucket = lat > 1 ? 63 - __builtin_clzl(lat) : 0;
+
+			r->count[op->op][order]++;
+			r->total_ns[op->op][order] += ns > 0 ? ns : 0;
+			if (lat > r->max_ns[op->op][order])
+				r->max_ns[op->op][order] = lat;
+			r->hist[op->op][order][bucket < NR_BUCKETS ? bucket : NR_BUCKETS - 1]++;
+		}
+	}
+	r->ns = now_ns() - start;
+	r->peak_bytes = allocator->peak_bytes();
+
+	for (uint32_t v = 0; v < t->nr_vars; v++)
+		if (vars[v] != NULL)
+			allocator->free(vars[v]);
+	allocator->teardown();
+	free(vars);
+	free(orders);
+}
+
+/* upper bound in ns of the bucket that holds the given fraction of a histogram */
+static unsigned long percentile(unsigned long *hist, unsigned long count, double frac)
+{
+	unsigned long seen = 0;
+
+	for (int k = 0; k < NR_BUCKETS; k++) {
+		seen += hist[k];
+		if (seen >= frac * count)
+			return 2UL << k;
+	}
+	return 2UL << (NR_BUCKETS - 1);
+}
+
+static void print_histograms(int buckets)
+{
+	printf("op,order,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+	for (int op = 0; op < TRACE_NR_OPS; op++) {
+		for (int o = 0; o < NR_ORDERS; o++) {
+			unsigned long n = timed.count[op][o];
+			if (n == 0)
+				continue;
+			printf("%s,%d,%lu,%.1f,%lu,%lu,%lu,%lu\n", op_names[op], o, n,
+			       timed.total_ns[op][o] / n, percentile(timed.hist[op][o], n, 0.5),
+			       percentile(timed.hist[op][o], n, 0.99),
+			       percentile(timed.hist[op][o], n, 0.999), timed.max_ns[op][o]);
+		}
+	}
+	if (!buckets)
+		return;
+
+	printf("op,order,below_ns,count\n");
+	for (int op = 0; op < TRACE_NR_OPS; op++)
+		for (int o = 0; o < NR_ORDERS; o++)
+			for (int k = 0; k < NR_BUCKETS; k++)
+				if (timed.hist[op][o][k] != 0)
+					printf("%s,%d,%lu,%lu\n", op_names[op], o, 2UL << k,
+					       timed.hist[op][o][k]);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = NULL;
+	int buckets = 0;
+	int csv = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:m:p:l:o:cH")) != -1) {
+		switch (opt) {
+		case 'a':
+			allocator = NULL;
+			for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+				if (strcmp(optarg, allocators[i].name) == 0)
+					allocator = &allocators[i];
+			if (allocator == NULL) {
+				fprintf(stderr, "%s: unknown allocator %s\n", argv[0], optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			arena_size = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'p':
+			min_order = atoi(optarg);
+			break;
+		case 'l':
+			lazy = atoi(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'c':
+			csv = 1;
+			break;
+		case 'H':
+			buckets = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a buddy|malloc] [-m arena_mib] [-p min_order] "
+				"[-l watermark] [-o out] [-c] [-H] trace\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "%s: expected one trace\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct trace t;
+	if (load_trace(argv[optind], &t) != 0) {
+		free_trace(&t);
+		return EXIT_FAILURE;
+	}
+	if (out != NULL) {
+		int ret = save_trace(out, &t);
+		free_trace(&t);
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	struct result whole;
+	memset(&whole, 0, sizeof(whole));
+	replay(&t, &timed, 1);
+	replay(&t, &whole, 0);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	if (csv) {
+		const char *name = strrchr(argv[optind], '/');
+		printf("%s,%s,", name ? name + 1 : argv[optind], allocator->name);
+	} else {
+		printf("ops,ns_per_op,failed,peak_bytes,peak_rss_kb\n");
+	}
+	/* only the per operation run follows the bytes held for every allocator */
+	printf("%lu,%.1f,%lu,%zu,%ld\n", (unsigned long)t.nr_ops,
+	       t.nr_ops ? whole.ns / t.nr_ops : 0, whole.failed, timed.peak_bytes, ru.ru_maxrss);
+	if (!csv)
+		print_histograms(buckets);
+	free_trace(&t);
+	return EXIT_SUCCESS;
+}
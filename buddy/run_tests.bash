@@ -5,6 +5,7 @@ TMP_FILE=$TEST_DIR/.tmp
 
 TEST_PREFIX=test_
 RESULT_PREFIX=result_
+ARGS_PREFIX=args_
 
 SUCCESSFUL_TESTS=""
 FAILED_TESTS=""
@@ -42,7 +43,15 @@ do
     echo "-----------------------------------------------------------"
     echo "Running test file:    $F"
 
-    ./buddy -i $F > $TMP_FILE
+    # options for the simulator, if the test has any
+    ARGS_FILE=`echo $F | sed "s/$TEST_PREFIX/$ARGS_PREFIX/g"`
+    ARGS=""
+    if [ -e "$ARGS_FILE" ]; then
+        ARGS=`cat $ARGS_FILE`
+        echo "Options:              $ARGS"
+    fi
+
+    ./buddy -i $F $ARGS > $TMP_FILE
 
     RESULT_FILE=`echo $F | sed "s/$TEST_PREFIX/$RESULT_PREFIX/g"`
 
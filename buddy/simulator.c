@@ -5,7 +5,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buddy.h"
 
@@ -34,12 +38,18 @@ typedef enum severity_t {
 typedef struct var_t {
 	void* mem;   ///< A pointer to a memory block
 	bool in_use; ///< Is this variable currently in use? This is probably redundant if we assume variables not in use are NULL. For now just leave it as it is
+	size_t size; ///< Bytes of the block filled with the fill byte, 0 if the contents are unknown
+	int fill;    ///< Fill byte, the name of the variable that allocated the block
 } var_t;
 
 
 static FILE *in = NULL;    // Input file
 static var_t var_map[256]; // Keep track of variable allocations
 static int linenum = 0;    // Line number in input file
+static buddy_t* arena;     // Arena the commands run on
+
+// Memory of the arena, the size of the default arena
+static char memory[1 << 20] __attribute__((aligned(1 << 20)));
 
 
 /**
@@ -49,7 +59,7 @@ static int linenum = 0;    // Line number in input file
  * @return Returns a pointer to location of the variable's
  * representation. Returns NULL if the var is not an alphabetic character.
  */
-static var_t* get_var(char var)
+static var_t* get_var(int var)
 {
 	if ((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'))
 		return &var_map[(int) var];
@@ -57,6 +67,53 @@ static var_t* get_var(char var)
 		return NULL;
 }
 
+/**
+ * Fill the block of a variable with its fill byte
+ *
+ * @param var The variable, in use
+ * @param name Name of the variable that allocated the block
+ * @param size Bytes requested
+ */
+static void fill_var(var_t* var, int name, size_t size)
+{
+	var->size = size;
+	var->fill = name;
+	memset(var->mem, name, size);
+}
+
+/**
+ * Check that the block of a variable still holds its fill byte, so that a
+ * write by the allocator into a block it has handed out shows up
+ *
+ * @param var The variable, in use
+ * @param len Bytes to check at most
+ * @return true if the bytes are intact
+ */
+static bool check_var(const var_t* var, size_t len)
+{
+	const unsigned char* mem = var->mem;
+
+	if (len > var->size)
+		len = var->size;
+	for (size_t i = 0; i < len; i++)
+		if (mem[i] != var->fill)
+			return false;
+	return true;
+}
+
+/**
+ * Stop checking the contents of a block given back, through every variable
+ * that still names it
+ *
+ * @param mem The block
+ */
+static void forget_block(const void* mem)
+{
+	for (int i = 0; i < 256; i++)
+		if (var_map[i].mem == mem)
+			var_map[i].size = 0;
+}
+
 /**
  * Multi-purpose fault error message
  *
@@ -83,53 +140,219 @@ static void print_fault(const char* cmd, const char* msg, severity_t sev)
 	fprintf(stderr, "    Faulting Command: %s\n", cmd);
 }
 
+/**
+ * A command in the input, read in place. Whitespace anywhere in a command is
+ * skipped as if it had been removed, and a NUL ends it like a C string.
+ */
+typedef struct command_t {
+	const char* start; ///< First character of the command
+	const char* pos;   ///< Next character to read
+	const char* end;   ///< End of the line
+} command_t;
+
+/**
+ * Read the next character of a command that is not whitespace
+ *
+ * @param cmd The command
+ * @return The character, or -1 at the end of the command
+ */
+static int next_char(command_t* cmd)
+{
+	while (cmd->pos < cmd->end) {
+		char c = *cmd->pos++;
+
+		switch (c) {
+		case ' ':
+		case '\n':
+		case '\r':
+		case '\t':
+			break;
+
+		case '\0':
+			cmd->pos = cmd->end;
+			return -1;
+
+		default:
+			return (unsigned char) c;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Look at the next character of a command without reading it
+ *
+ * @param cmd The command
+ * @return The character, or -1 at the end of the command
+ */
+static int peek_char(const command_t* cmd)
+{
+	command_t copy = *cmd;
+
+	return next_char(&copy);
+}
+
+/**
+ * Read a literal string
+ *
+ * @param cmd The command
+ * @param lit The literal
+ * @return Returns true if the command goes on with the literal
+ */
+static bool match(command_t* cmd, const char* lit)
+{
+	while (*lit != '\0') {
+		if (next_char(cmd) != *lit++)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Search the rest of a command for a literal string, without reading it
+ *
+ * @param cmd The command
+ * @param lit The literal
+ * @return Returns true if the literal is in the rest of the command
+ */
+static bool contains(const command_t* cmd, const char* lit)
+{
+	command_t from = *cmd;
+
+	do {
+		command_t copy = from;
+
+		if (match(&copy, lit))
+			return true;
+	} while (next_char(&from) != -1);
+
+	return false;
+}
+
+/**
+ * Read a decimal integer with an optional plus sign. Counts and sizes are
+ * never negative, so a minus sign is not a number.
+ *
+ * @param cmd The command
+ * @param value Receives the integer
+ * @return Returns true if there was an integer that fits a size_t
+ */
+static bool read_size_t(command_t* cmd, size_t* value)
+{
+	int c = peek_char(cmd);
+	size_t v = 0;
+
+	if (c == '+') {
+		next_char(cmd);
+		c = peek_char(cmd);
+	}
+
+	if (c < '0' || c > '9')
+		return false;
+
+	while (c >= '0' && c <= '9') {
+		next_char(cmd);
+		if (v > (SIZE_MAX - (c - '0')) / 10)
+			return false;
+		v = v * 10 + (c - '0');
+		c = peek_char(cmd);
+	}
+
+	*value = v;
+	return true;
+}
+
+/**
+ * Spell out a command without its whitespace, for fault messages
+ *
+ * @param cmd The command
+ * @return The command text, valid until the next call
+ */
+static const char* command_text(const command_t* cmd)
+{
+	static char* text = NULL;
+	static size_t text_len = 0;
+
+	command_t copy = { cmd->start, cmd->start, cmd->end };
+	size_t len = cmd->end - cmd->start + 1;
+	size_t n = 0;
+	int c;
+
+	if (len > text_len) {
+		char* grown = realloc(text, len);
+
+		if (grown == NULL)
+			return "";
+		text = grown;
+		text_len = len;
+	}
+
+	while ((c = next_char(&copy)) != -1)
+		text[n++] = c;
+	text[n] = '\0';
+
+	return text;
+}
+
 /**
  * Throw a parsing error
  *
- * @param cmd A string representing the faulting command
+ * @param cmd The faulting command
  * @return Returns BADINPUT status
  */
-static status_t parse_error(const char* cmd)
+static status_t parse_error(const command_t* cmd)
 {
-	print_fault(cmd, "Failed to parse command", ERROR);
+	print_fault(command_text(cmd), "Failed to parse command", ERROR);
 	return BADINPUT;
 }
 
+/**
+ * Read the size of an allocation, in bytes or with a K suffix, and the
+ * closing bracket
+ *
+ * @param cmd The command, just past the opening bracket or comma
+ * @param size Receives the size in bytes
+ * @return Returns true if the size was read and fits a size_t
+ */
+static bool read_size(command_t* cmd, size_t* size)
+{
+	if (!read_size_t(cmd, size))
+		return false;
+
+	// Check what follows the number
+	switch (next_char(cmd)) {
+	case 'k':
+	case 'K':
+		if (*size > SIZE_MAX / 1024)
+			return false;
+		*size *= 1024;
+		// fall through
+	case ')':
+		return true;
+	default:
+		return false;
+	}
+}
+
 /**
  * Parses an allocation instruction
  *
- * @param cmd String representing an allocation command in the program
+ * @param cmd Allocation command, read up to the '='
+ * @param var_name Name of the variable assigned to
  * @returns Status of read and execute
  */
-static status_t parse_alloc(char* cmd)
+static status_t parse_alloc(command_t* cmd, int var_name)
 {
-	assert(cmd != NULL);
-	assert(cmd[0] != '\0');
-
-	char var_name;
-	int size;
-	char alter_size;
-	int matched;
-
-	errno = 0;
-	matched = sscanf(cmd, "%c=alloc(%d%c)", &var_name, &size, &alter_size);
-
-	// Error check sprintf
-	if (matched == 3 && errno == 0) {
-		// Check what the alter_size variable actually contains
-		switch (alter_size) {
-		case 'k':
-		case 'K':
-			size *= 1024;
-		case ')':
-			break;
-		default:
-			return parse_error(cmd);
-		}
-	}
-	else {
+	size_t size;
+
+	if (!match(cmd, "alloc("))
+		return parse_error(cmd);
+
+	// A command that names realloc anywhere is taken for a reallocation
+	if (contains(cmd, "realloc") || !read_size(cmd, &size))
 		return parse_error(cmd);
-	}
 
 	// Resolve variable
 	var_t* var = get_var(var_name);
@@ -138,124 +361,323 @@ static status_t parse_alloc(char* cmd)
 		return parse_error(cmd);
 
 	// Allocate variable
-	var->mem = buddy_alloc(size);
+	var->mem = buddy_arena_alloc(arena, size);
 
 	if (var->mem == NULL) {
-		print_fault(cmd, "buddy_alloc returned NULL", WARNING);
+		print_fault(command_text(cmd), "buddy_alloc returned NULL", WARNING);
 		printf("Out of memory\n");
 		return OUTOFMEMORY;
 	}
 
 	var->in_use = true;
+	fill_var(var, var_name, size);
 
 	return SUCCESS;
 }
 
 /**
- * Parses a free instruction
+ * Parses a reallocation instruction
  *
- * @param cmd String representing an allocation command in the program
+ * @param cmd Reallocation command, read up to the '='
+ * @param var_name Name of the variable assigned to
  * @returns Status of read and execute
  */
-static status_t parse_free(char* cmd)
+static status_t parse_realloc(command_t* cmd, int var_name)
 {
-	assert(cmd != NULL);
+	int src_name;
+	size_t size;
 
-	char var_name;
-	int matched;
-	var_t* var;
+	if (!match(cmd, "realloc(") || (src_name = next_char(cmd)) == -1 ||
+	    !match(cmd, ",") || !read_size(cmd, &size))
+		return parse_error(cmd);
 
-	// Read the command string
-	errno = 0;
-	matched = sscanf(cmd, "free(%c)", &var_name);
+	// Resolve variables
+	var_t* var = get_var(var_name);
+	var_t* src = get_var(src_name);
 
-	// Check if sscanf was valid
-	if (matched != 1 || errno != 0 || (var = get_var(var_name)) == NULL)
+	if (var == NULL || src == NULL)
 		return parse_error(cmd);
 
-	// Ensure that the variable is in use
-	if (!var->in_use) {
-		print_fault(cmd, "Double free", ERROR);
+	// Ensure that the source variable is in use
+	if (!src->in_use) {
+		print_fault(command_text(cmd), "Reallocating a free variable", ERROR);
 		return DOUBLEFREE;
 	}
 
-	// Free variable
-	buddy_free(var->mem);
-	var->mem = NULL;
-	var->in_use = false;
+	// Reallocate, the source is left alone if this fails
+	void* old = src->mem;
+	void* mem = buddy_arena_realloc(arena, old, size);
+
+	if (mem == NULL) {
+		print_fault(command_text(cmd), "buddy_realloc returned NULL", WARNING);
+		printf("Out of memory\n");
+		return OUTOFMEMORY;
+	}
+
+	// The contents must have come along as far as they fit
+	var_t moved = *src;
+
+	moved.mem = mem;
+	if (!check_var(&moved, size)) {
+		print_fault(command_text(cmd), "Block contents overwritten", ERROR);
+		printf("Corrupted block\n");
+	}
+
+	forget_block(old);
+	src->mem = NULL;
+	src->in_use = false;
+	var->mem = mem;
+	var->in_use = true;
+	fill_var(var, var_name, size);
+
+	return SUCCESS;
+}
+
+/**
+ * Parses a bulk allocation instruction, which assigns count blocks of one
+ * size to the variable and the ones after it in the alphabet
+ *
+ * @param cmd Bulk allocation command, read up to the '='
+ * @param var_name Name of the first variable assigned to
+ * @returns Status of read and execute
+ */
+static status_t parse_bulk(command_t* cmd, int var_name)
+{
+	void* mem[26];
+	size_t n;
+	size_t size;
+
+	if (!match(cmd, "bulk(") || !read_size_t(cmd, &n) || !match(cmd, ",") ||
+	    !read_size(cmd, &size) || n < 1 || n > 26)
+		return parse_error(cmd);
+
+	int count = (int) n;
+
+	// Every variable must be a letter of the same case
+	if (get_var(var_name) == NULL || get_var(var_name + count - 1) == NULL ||
+	    (var_name <= 'Z') != (var_name + count - 1 <= 'Z'))
+		return parse_error(cmd);
+
+	int got = buddy_arena_alloc_bulk(arena, size, count, mem);
+
+	for (int i = 0; i < got; i++) {
+		var_t* var = get_var(var_name + i);
+
+		var->mem = mem[i];
+		var->in_use = true;
+		fill_var(var, var_name + i, size);
+	}
+
+	if (got < count) {
+		print_fault(command_text(cmd), "buddy_alloc_bulk returned too few blocks", WARNING);
+		printf("Out of memory\n");
+		return OUTOFMEMORY;
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * Parses a reset instruction. The variables keep their addresses, so
+ * freeing one afterwards is an invalid free unless another allocation has
+ * handed its address out again.
+ *
+ * @param cmd Reset command, read up to the 'r'
+ * @returns Status of read and execute
+ */
+static status_t parse_reset(command_t* cmd)
+{
+	if (!match(cmd, "eset()") || next_char(cmd) != -1)
+		return parse_error(cmd);
+
+	buddy_arena_reset(arena);
+
+	// Whatever the variables point to is free now or handed out again
+	for (int i = 0; i < 256; i++)
+		var_map[i].size = 0;
 
 	return SUCCESS;
 }
 
+/**
+ * Parses a copy instruction, which makes a second variable name the block
+ * of another, so that freeing both hands the allocator a double free
+ *
+ * @param cmd Copy command, read up to the '='
+ * @param var_name Name of the variable assigned to
+ * @returns Status of read and execute
+ */
+static status_t parse_copy(command_t* cmd, int var_name)
+{
+	var_t* var = get_var(var_name);
+	var_t* src = get_var(next_char(cmd));
+
+	if (var == NULL || src == NULL)
+		return parse_error(cmd);
+
+	*var = *src;
+
+	return SUCCESS;
+}
 
 /**
- * Simplify the command and call one of the sub parser functions
+ * Parses a free instruction. free(X+size) frees an address that many bytes
+ * into the block of X, which the allocator must turn away.
  *
- * @param cmd Raw command string. This parameter is mutated. This
- * parameter cannot be NULL.
- * @param cmd_len Length in bytes of the command string.
- * @return Program status.
+ * @param cmd Free command, read up to the 'f'
+ * @returns Status of read and execute
  */
-static status_t parse_command(char* cmd, int cmd_len)
+static status_t parse_free(command_t* cmd)
 {
-	assert(cmd != NULL);
+	int var_name;
+	size_t offset = 0;
+	var_t* var;
 
-	int ws_cursor = 0;
+	if (!match(cmd, "ree("))
+		return parse_error(cmd);
 
-	if (cmd[0] == '\0' || cmd[0] == '\n' || cmd[0] == '\r')
-		return SUCCESS;
+	// A command that names alloc anywhere is taken for an allocation. The
+	// closing bracket is not checked without an offset.
+	if (contains(cmd, "alloc") || (var_name = next_char(cmd)) == -1 ||
+	    (var = get_var(var_name)) == NULL)
+		return parse_error(cmd);
 
-	// remove whitespace from command
-	for (int i = 0; i < cmd_len; ++i) {
-		switch (cmd[i]) {
-		case ' ':
-		case '\n':
-		case '\r':
-		case '\t':
-			break;
+	if (peek_char(cmd) == '+' && (!match(cmd, "+") || !read_size(cmd, &offset)))
+		return parse_error(cmd);
 
-		default:
-			cmd[ws_cursor++] = cmd[i];
+	// Ensure that the variable is in use
+	if (!var->in_use) {
+		print_fault(command_text(cmd), "Double free", ERROR);
+		return DOUBLEFREE;
+	}
+
+	// Only a block that is still live must hold what was written to it
+	bool intact = offset != 0 || check_var(var, var->size);
+
+	// Free variable, the block stays in use if only an address inside it is freed
+	int rc = buddy_arena_free(arena, (char*) var->mem + offset);
+
+	if (offset == 0) {
+		if (rc == 0 && !intact) {
+			print_fault(command_text(cmd), "Block contents overwritten", ERROR);
+			printf("Corrupted block\n");
 		}
+		if (rc == 0)
+			forget_block(var->mem);
+		var->mem = NULL;
+		var->in_use = false;
 	}
 
-	status_t status;
+	// An address that is not a live block must be turned away
+	if (rc != 0) {
+		print_fault(command_text(cmd), "buddy_free turned the address away", WARNING);
+		printf("Invalid free\n");
+	}
+
+	return SUCCESS;
+}
+
+
+/**
+ * Tokenize a command in place and call one of the sub parser functions
+ *
+ * @param line First character of the line. This parameter cannot be NULL.
+ * @param end End of the line.
+ * @return Program status.
+ */
+static status_t parse_command(const char* line, const char* end)
+{
+	assert(line != NULL);
+
+	if (line == end || line[0] == '\0' || line[0] == '\n' || line[0] == '\r')
+		return SUCCESS;
 
-	// We have 2 commands: alloc and free.
-	if (strstr(cmd, "alloc") != NULL)
-		status = parse_alloc(cmd);
-	else if (strstr(cmd, "free") != NULL)
-		status = parse_free(cmd);
+	command_t cmd = { line, line, end };
+	status_t status;
+	int first = next_char(&cmd);
+
+	// We have 6 commands: X=alloc(size), X=realloc(Y,size), X=bulk(count,size),
+	// X=Y, free(X) and reset().
+	if (peek_char(&cmd) == '=') {
+		command_t rest = cmd;
+
+		next_char(&cmd);
+		next_char(&rest);
+		next_char(&rest);
+		if (next_char(&rest) == -1)
+			status = parse_copy(&cmd, first);
+		else if (peek_char(&cmd) == 'r')
+			status = parse_realloc(&cmd, first);
+		else if (peek_char(&cmd) == 'b')
+			status = parse_bulk(&cmd, first);
+		else
+			status = parse_alloc(&cmd, first);
+	}
+	else if (first == 'f')
+		status = parse_free(&cmd);
+	else if (first == 'r')
+		status = parse_reset(&cmd);
 	else
-		return parse_error(cmd);
+		return parse_error(&cmd);
 
 	if (status != SUCCESS)
 		return status;
 
 	// Output free blocks
-	buddy_dump();
+	buddy_arena_dump(arena);
 
 	return SUCCESS;
 }
 
 /**
- * Feed each line of a file into the function parse_command
+ * Feed each line of the input into the function parse_command
+ *
+ * Regular files are mapped and parsed in place, anything else is read a line
+ * at a time.
  *
  * @return Program status.
  */
 static status_t parse_file()
 {
+	int fd = fileno(in);
+	struct stat st;
+	off_t offset;
+
+	status_t status = SUCCESS;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && offset < st.st_size) {
+		char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (map != MAP_FAILED) {
+			const char* pos = map + offset;
+			const char* end = map + st.st_size;
+
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			while (status == SUCCESS && pos < end) {
+				const char* eol = memchr(pos, '\n', end - pos);
+				const char* next = eol != NULL ? eol + 1 : end;
+
+				++linenum;
+				status = parse_command(pos, next);
+				pos = next;
+			}
+
+			munmap(map, st.st_size);
+			return status;
+		}
+	}
+
 	char* line = NULL;
 	size_t len = 0;
 	ssize_t read;
 
-	status_t status = SUCCESS;
-
 	while (status == SUCCESS && (read = getline(&line, &len, in)) > 0) {
 		++linenum;
-		status = parse_command(line, len);
+		status = parse_command(line, line + read);
 	}
 
+	free(line);
 	return status;
 }
 
@@ -269,31 +691,81 @@ static status_t parse_file()
 void print_usage(char* prog_name, FILE* out)
 {
 	fprintf(out, "Usage:\n");
-	fprintf(out, "  ./%s [-i filename]\n", prog_name);
+	fprintf(out, "  ./%s [-i filename] [-l watermark] [-p order] [-s] [-t]\n", prog_name);
 	fprintf(out, "     -i [optional] - Specify an input file name to read from. If this option \n");
 	fprintf(out, "                     is not used then input is expected from standard input.\n");
+	fprintf(out, "     -l [optional] - Coalesce lazily, keeping up to watermark freed blocks per\n");
+	fprintf(out, "                     order unmerged.\n");
+	fprintf(out, "     -p [optional] - Order of the pages, 12 (4K) by default. The arena is 1M.\n");
+	fprintf(out, "     -s [optional] - Print the split and merge counts to standard error at the end.\n");
+	fprintf(out, "     -t [optional] - Trim every block to the pages its request needs.\n");
+}
+
+/**
+ * Print the total split and merge counts of the default arena
+ *
+ * @param out File stream to write to.
+ */
+void print_split_merge(FILE* out)
+{
+	buddy_stats_t st;
+	unsigned long splits = 0;
+	unsigned long merges = 0;
+
+	buddy_arena_stats(arena, &st);
+	for (int o = 0; o < BUDDY_NR_ORDERS; o++) {
+		splits += st.splits[o];
+		merges += st.merges[o];
+	}
+	fprintf(out, "splits: %lu merges: %lu\n", splits, merges);
 }
 
 int main(int argc, char** argv)
 {
 	int opt;
+	int lazy = 0;
+	int print_stats = 0;
+	int trim = 0;
+	int page_order = 12;
 
 	status_t prog_status;
 
 	in = stdin;
 
 	// Parse command line options
-	while ((opt = getopt(argc, argv, "i:")) != -1) {
+	while ((opt = getopt(argc, argv, "i:l:p:st")) != -1) {
 		switch (opt) {
 		case 'i':
 			in = fopen(optarg, "r");
 			break;
 
+		case 'l':
+			lazy = atoi(optarg);
+			break;
+
+		case 'p':
+			page_order = atoi(optarg);
+			break;
+
+		case 's':
+			print_stats = 1;
+			break;
+
+		case 't':
+			trim = 1;
+			break;
+
 		case '?':
 			switch (optopt) {
 			case 'i':
 				fprintf(stderr, "ERROR: Missing filename after '%c'", optopt);
 				return EXIT_FAILURE;
+			case 'l':
+				fprintf(stderr, "ERROR: Missing watermark after '%c'", optopt);
+				return EXIT_FAILURE;
+			case 'p':
+				fprintf(stderr, "ERROR: Missing page order after '%c'", optopt);
+				return EXIT_FAILURE;
 			}
 
 			print_usage(argv[0], stdout);
@@ -310,9 +782,25 @@ int main(int argc, char** argv)
 	// Zero memory
 	memset(var_map, 0, sizeof(var_map));
 
+	// Every command dumps the free lists, so batch the output unless it is read live
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
 	// Execute program
-	buddy_init();
+	arena = buddy_create(memory, sizeof(memory), page_order);
+	if (arena == NULL) {
+		fprintf(stderr, "ERROR: Failed to create an arena with %d bit pages.\n", page_order);
+		return EXIT_FAILURE;
+	}
+	if (lazy > 0 && buddy_arena_set_lazy(arena, lazy) != 0) {
+		fprintf(stderr, "ERROR: Lazy coalescing is not supported by this build.\n");
+		return EXIT_FAILURE;
+	}
+	if (trim)
+		buddy_arena_set_trim(arena, 1);
 	prog_status = parse_file();
+	if (print_stats)
+		print_split_merge(stderr);
 
 	if (in != stdin)
 		fclose(in);
@@ -0,0 +1,450 @@
+/**
+ * Slab Allocator
+ *
+ * Objects of up to SLAB_MAX_OBJECT bytes are rounded up to a size class and
+ * carved out of slabs, SLAB_SIZE blocks taken from a buddy arena. A slab holds
+ * objects of a single class and starts with a header whose bitmap marks its
+ * free objects. Slabs that become empty go back to the arena, except for one
+ * spare per class that absorbs alloc/free ping-pong at a slab boundary.
+ *
+ * Every slab is a block of the same order, so all slabs sit at the same
+ * offset modulo SLAB_SIZE. That offset is learned once, and from then on the
+ * slab of any object is found with a mask. A free checks that the address
+ * lies among the slabs handed out, that its slab carries SLAB_MAGIC and that
+ * it is an allocated object of the slab before it touches anything.
+ */
+
+
+/**************************************************************************
+ * Conditional Compilation Options
+ **************************************************************************/
+
+/* Thread safe slabs: one lock per size class. Build with -DUSE_THREADS=1 */
+#ifndef USE_THREADS
+#define USE_THREADS 0
+#endif
+
+/**************************************************************************
+ * Included Files
+ **************************************************************************/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#if USE_THREADS
+#include <pthread.h>
+#endif
+
+#include "list.h"
+#include "slab.h"
+
+/**************************************************************************
+ * Public Definitions
+ **************************************************************************/
+
+/* order of a slab */
+#define SLAB_ORDER 14
+#define SLAB_SIZE (1UL << SLAB_ORDER)
+
+/* granularity and alignment of objects */
+#define SLAB_ALIGN 16
+
+/* number of size classes, see slab_create() */
+#define NR_CLASSES 24
+
+/* marks a block that is a slab of some allocator */
+#define SLAB_MAGIC 0x51ab
+
+/* slab that holds an object */
+#define SLAB_OF(s, addr) \
+	((struct slab *)((((uintptr_t)(addr) - (s)->phase) & ~(SLAB_SIZE - 1)) + (s)->phase))
+
+#if USE_THREADS
+#  define CLASS_LOCK(c) pthread_mutex_lock(&(c)->lock)
+#  define CLASS_UNLOCK(c) pthread_mutex_unlock(&(c)->lock)
+#else
+#  define CLASS_LOCK(c)
+#  define CLASS_UNLOCK(c)
+#endif
+
+/**************************************************************************
+ * Public Types
+ **************************************************************************/
+
+/**
+ * Slab header, at the start of every slab. The objects follow the bitmap.
+ */
+struct slab {
+	struct list_head list;   ///< on the partial or full list of its class
+	uint16_t class;          ///< size class of the objects
+	uint16_t nr_free;        ///< free objects in the slab
+	uint16_t hint;           ///< no bitmap word below this one has a free object
+	uint16_t magic;          ///< SLAB_MAGIC until the slab goes back to the arena
+	uint64_t free_map[];     ///< one bit per object, set while it is free
+};
+
+/**
+ * Slabs of one object size
+ */
+struct slab_class {
+	uint16_t size;             ///< object size in bytes
+	uint16_t nr_objects;       ///< objects per slab
+	uint16_t offset;           ///< offset of the first object in a slab
+	uint16_t nr_words;         ///< bitmap words per slab
+	uint32_t reciprocal;       ///< 2^32 / size rounded up, to divide offsets by size
+	struct list_head partial;  ///< slabs with free and allocated objects
+	struct list_head full;     ///< slabs without free objects
+	struct slab *spare;        ///< an empty slab kept back, or NULL
+#if USE_THREADS
+	pthread_mutex_t lock;      ///< protects the slabs of the class
+#endif
+};
+
+/**
+ * Size class front end of one arena
+ */
+struct slab_allocator {
+	buddy_t *arena;            ///< arena the slabs come from, NULL for the default arena
+	uintptr_t phase;           ///< address of every slab modulo SLAB_SIZE
+	uintptr_t lo;              ///< lowest slab ever set up
+	uintptr_t hi;              ///< end of the highest slab ever set up
+	uint8_t class_of[SLAB_MAX_OBJECT / SLAB_ALIGN + 1];  ///< size class by size / SLAB_ALIGN
+	struct slab_class classes[NR_CLASSES];
+};
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/**
+ * Take a block for a slab from the arena
+ * @param s slab allocator
+ * @return the block, or NULL if the arena is out of memory
+ */
+static void *slab_page_alloc(slab_allocator_t *s)
+{
+	return s->arena ? buddy_arena_alloc(s->arena, SLAB_SIZE) : buddy_alloc(SLAB_SIZE);
+}
+
+/**
+ * Give the block of a slab back to the arena
+ * @param s slab allocator
+ * @param slab the slab
+ */
+static void slab_page_free(slab_allocator_t *s, struct slab *slab)
+{
+	slab->magic = 0;
+	if (s->arena)
+	{
+		buddy_arena_free(s->arena, slab);
+	}
+	else
+	{
+		buddy_free(slab);
+	}
+}
+
+/**
+ * Widen the range of addresses slab_free() accepts to a new slab
+ * @param s slab allocator
+ * @param slab the slab
+ */
+static void slab_cover(slab_allocator_t *s, struct slab *slab)
+{
+	uintptr_t lo = __atomic_load_n(&s->lo, __ATOMIC_RELAXED);
+	uintptr_t hi = __atomic_load_n(&s->hi, __ATOMIC_RELAXED);
+
+	while ((uintptr_t)slab < lo &&
+	       !__atomic_compare_exchange_n(&s->lo, &lo, (uintptr_t)slab, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+	while ((uintptr_t)slab + SLAB_SIZE > hi &&
+	       !__atomic_compare_exchange_n(&s->hi, &hi, (uintptr_t)slab + SLAB_SIZE, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+}
+
+/**
+ * Set up a new slab with every object free
+ * @param s slab allocator
+ * @param c size class of the slab
+ * @return the slab, or NULL if the arena is out of memory
+ */
+static struct slab *slab_new(slab_allocator_t *s, struct slab_class *c)
+{
+	struct slab *slab = slab_page_alloc(s);
+	if (slab == NULL)
+	{
+		return NULL;
+	}
+
+	slab->class = c - s->classes;
+	slab->nr_free = c->nr_objects;
+	slab->hint = 0;
+	slab->magic = SLAB_MAGIC;
+	for (int w = 0; w < c->nr_words; w++)
+	{
+		slab->free_map[w] = ~0ULL;
+	}
+	/* no objects past the end of the slab */
+	if (c->nr_objects % 64 != 0)
+	{
+		slab->free_map[c->nr_words - 1] = (1ULL << (c->nr_objects % 64)) - 1;
+	}
+	slab_cover(s, slab);
+	return slab;
+}
+
+/**
+ * Work out the slab layout of a size class
+ * @param c size class
+ * @param size object size, a multiple of SLAB_ALIGN
+ */
+static void slab_class_init(struct slab_class *c, int size)
+{
+	int n = (SLAB_SIZE - sizeof(struct slab)) / size;
+	size_t offset;
+
+	/* shrink until header, bitmap and objects fit */
+	for (;;)
+	{
+		size_t words = (n + 63) / 64;
+		offset = (sizeof(struct slab) + words * sizeof(uint64_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1UL);
+		if (offset + (size_t)n * size <= SLAB_SIZE)
+		{
+			break;
+		}
+		n--;
+	}
+
+	c->size = size;
+	c->nr_objects = n;
+	c->offset = offset;
+	c->nr_words = (n + 63) / 64;
+	/* exact for every offset inside a slab, which is far below 2^32 / size */
+	c->reciprocal = ((1ULL << 32) + size - 1) / size;
+	INIT_LIST_HEAD(&c->partial);
+	INIT_LIST_HEAD(&c->full);
+	c->spare = NULL;
+#if USE_THREADS
+	pthread_mutex_init(&c->lock, NULL);
+#endif
+}
+
+/**
+ * Create a slab allocator on top of a buddy arena
+ *
+ * Size classes go up in steps of 16 bytes to 128 bytes and then in four
+ * steps per power of two, so no object wastes more than a fifth of its slot.
+ * One slab is allocated and freed right away to learn where slabs sit in the
+ * arena.
+ *
+ * @param b arena the slabs are taken from, or NULL for the default arena
+ * @return the allocator, or NULL if out of memory
+ */
+slab_allocator_t *slab_create(buddy_t *b)
+{
+	slab_allocator_t *s = malloc(sizeof(*s));
+	if (s == NULL)
+	{
+		return NULL;
+	}
+	s->arena = b;
+	s->lo = UINTPTR_MAX;
+	s->hi = 0;
+
+	void *probe = slab_page_alloc(s);
+	if (probe == NULL)
+	{
+		free(s);
+		return NULL;
+	}
+	s->phase = (uintptr_t)probe & (SLAB_SIZE - 1);
+	slab_page_free(s, probe);
+
+	int nr = 0;
+	int size = 0;
+	while (size < SLAB_MAX_OBJECT)
+	{
+		int step = size < 128 ? SLAB_ALIGN : (1 << (31 - __builtin_clz(size))) / 4;
+		size += step;
+		slab_class_init(&s->classes[nr], size);
+		/* every size up to this one that no smaller class holds */
+		for (int i = (size - step) / SLAB_ALIGN + 1; i <= size / SLAB_ALIGN; i++)
+		{
+			s->class_of[i] = nr;
+		}
+		nr++;
+	}
+	s->class_of[0] = 0;
+
+	return s;
+}
+
+/**
+ * Give every slab back to the arena and release the allocator
+ *
+ * Objects still allocated are released with their slabs.
+ *
+ * @param s slab allocator, may be NULL
+ */
+void slab_destroy(slab_allocator_t *s)
+{
+	if (s == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < NR_CLASSES; i++)
+	{
+		struct slab_class *c = &s->classes[i];
+		struct slab *slab, *next;
+
+		list_for_each_entry_safe(slab, next, &c->partial, list)
+		{
+			slab_page_free(s, slab);
+		}
+		list_for_each_entry_safe(slab, next, &c->full, list)
+		{
+			slab_page_free(s, slab);
+		}
+		if (c->spare != NULL)
+		{
+			slab_page_free(s, c->spare);
+		}
+#if USE_THREADS
+		pthread_mutex_destroy(&c->lock);
+#endif
+	}
+	free(s);
+}
+
+/**
+ * Allocate a small object
+ *
+ * The object comes from the most recently used slab of its size class that
+ * has room. Only when the class has no room left is a slab taken from the
+ * arena.
+ *
+ * @param s slab allocator
+ * @param size size in bytes, at most SLAB_MAX_OBJECT
+ * @return object address, aligned to 16 bytes, or NULL if out of memory
+ */
+void *slab_alloc(slab_allocator_t *s, size_t size)
+{
+	if (size == 0 || size > SLAB_MAX_OBJECT)
+	{
+		return NULL;
+	}
+
+	struct slab_class *c = &s->classes[s->class_of[(size + SLAB_ALIGN - 1) / SLAB_ALIGN]];
+	struct slab *slab;
+
+	CLASS_LOCK(c);
+	if (list_empty(&c->partial))
+	{
+		slab = c->spare != NULL ? c->spare : slab_new(s, c);
+		c->spare = NULL;
+		if (slab == NULL)
+		{
+			CLASS_UNLOCK(c);
+			return NULL;
+		}
+		list_add(&slab->list, &c->partial);
+	}
+	slab = list_entry(c->partial.next, struct slab, list);
+
+	int w = slab->hint;
+	while (slab->free_map[w] == 0)
+	{
+		w++;
+	}
+	int bit = __builtin_ctzll(slab->free_map[w]);
+	slab->free_map[w] &= slab->free_map[w] - 1;
+	slab->hint = w;
+	if (--slab->nr_free == 0)
+	{
+		list_move(&slab->list, &c->full);
+	}
+	CLASS_UNLOCK(c);
+
+	return (char *)slab + c->offset + (size_t)(w * 64 + bit) * c->size;
+}
+
+/**
+ * Free a small object
+ *
+ * A slab that becomes empty is kept as the spare of its class, or given back
+ * to the arena if the class already has one. An address outside the slabs,
+ * into the middle of an object or of an object that is free already is
+ * turned away without a change.
+ *
+ * @param s slab allocator
+ * @param addr object address returned by slab_alloc(), may be NULL
+ * @return 0, or -1 if addr is not an allocated object of the allocator
+ */
+int slab_free(slab_allocator_t *s, void *addr)
+{
+	if (addr == NULL)
+	{
+		return 0;
+	}
+	if ((uintptr_t)addr < __atomic_load_n(&s->lo, __ATOMIC_RELAXED) ||
+	    (uintptr_t)addr >= __atomic_load_n(&s->hi, __ATOMIC_RELAXED))
+	{
+		return -1;
+	}
+
+	/* inside the range the slab header is arena memory, so it can be read */
+	struct slab *slab = SLAB_OF(s, addr);
+	if (slab->magic != SLAB_MAGIC || slab->class >= NR_CLASSES)
+	{
+		return -1;
+	}
+	struct slab_class *c = &s->classes[slab->class];
+	if ((char *)addr < (char *)slab + c->offset)
+	{
+		return -1;
+	}
+	size_t offset = (char *)addr - (char *)slab - c->offset;
+	unsigned int index = ((uint64_t)offset * c->reciprocal) >> 32;
+	if (index >= c->nr_objects || (size_t)index * c->size != offset)
+	{
+		return -1;
+	}
+	struct slab *release = NULL;
+
+	CLASS_LOCK(c);
+	if (slab->free_map[index / 64] & (1ULL << (index % 64)))
+	{
+		CLASS_UNLOCK(c);
+		return -1;
+	}
+	slab->free_map[index / 64] |= 1ULL << (index % 64);
+	if (index / 64 < slab->hint)
+	{
+		slab->hint = index / 64;
+	}
+	if (slab->nr_free++ == 0)
+	{
+		list_move(&slab->list, &c->partial);
+	}
+	if (slab->nr_free == c->nr_objects)
+	{
+		list_del(&slab->list);
+		if (c->spare == NULL)
+		{
+			c->spare = slab;
+		}
+		else
+		{
+			release = slab;
+		}
+	}
+	CLASS_UNLOCK(c);
+
+	if (release != NULL)
+	{
+		slab_page_free(s, release);
+	}
+	return 0;
+}
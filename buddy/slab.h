@@ -0,0 +1,19 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "buddy.h"
+
+/* largest object served from slabs, larger requests belong to the buddy API */
+#define SLAB_MAX_OBJECT 2048
+
+/**
+ * Size class allocator for small objects on top of a buddy arena
+ */
+typedef struct slab_allocator slab_allocator_t;
+
+slab_allocator_t *slab_create(buddy_t *b);
+void slab_destroy(slab_allocator_t *s);
+void *slab_alloc(slab_allocator_t *s, size_t size);
+int slab_free(slab_allocator_t *s, void *addr);
+
+#endif // SLAB_H
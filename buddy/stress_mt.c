@@ -0,0 +1,162 @@
+/**
+ * Concurrent stress test and tail latency report
+ *
+ * Threads hammer one shared arena with random alloc/free of 4K-64K blocks.
+ * Every block is stamped with its owner on allocation and the stamp is
+ * checked before it is freed, so handing one block out twice is caught.
+ * After all threads have freed everything, the free block invariants are
+ * checked and the whole arena must be free again.
+ *
+ * Usage: ./stress_mt [threads]
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define ARENA_SIZE (16 << 20)
+#define LIVE_SLOTS 128
+#define OPS_PER_THREAD 200000
+
+typedef struct {
+	int id;
+	int corrupted;
+	int nr_alloc;
+	int nr_free;
+	uint32_t alloc_ns[OPS_PER_THREAD];
+	uint32_t free_ns[OPS_PER_THREAD];
+} worker_t;
+
+static buddy_t *arena;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stamp(void *block, int size, uint64_t tag)
+{
+	memcpy(block, &tag, sizeof(tag));
+	memcpy((char *)block + size - sizeof(tag), &tag, sizeof(tag));
+}
+
+static int stamped(void *block, int size, uint64_t tag)
+{
+	return memcmp(block, &tag, sizeof(tag)) == 0 &&
+	       memcmp((char *)block + size - sizeof(tag), &tag, sizeof(tag)) == 0;
+}
+
+static void *worker(void *arg)
+{
+	worker_t *w = arg;
+	unsigned int seed = w->id + 1;
+	void *live[LIVE_SLOTS] = { NULL };
+	int sizes[LIVE_SLOTS];
+	uint64_t tags[LIVE_SLOTS];
+
+	for (int i = 0; i < OPS_PER_THREAD; i++) {
+		int slot = rand_r(&seed) % LIVE_SLOTS;
+		uint64_t start = now_ns();
+
+		if (live[slot] != NULL) {
+			if (!stamped(live[slot], sizes[slot], tags[slot]))
+				w->corrupted++;
+			start = now_ns();
+			buddy_arena_free(arena, live[slot]);
+			w->free_ns[w->nr_free++] = now_ns() - start;
+			live[slot] = NULL;
+		} else {
+			int size = 4096 << (rand_r(&seed) % 5);
+			void *block = buddy_arena_alloc(arena, size);
+			w->alloc_ns[w->nr_alloc++] = now_ns() - start;
+			if (block != NULL) {
+				live[slot] = block;
+				sizes[slot] = size;
+				tags[slot] = ((uint64_t)w->id << 32) | i;
+				stamp(block, size, tags[slot]);
+			}
+		}
+	}
+	for (int slot = 0; slot < LIVE_SLOTS; slot++) {
+		if (live[slot] != NULL) {
+			if (!stamped(live[slot], sizes[slot], tags[slot]))
+				w->corrupted++;
+			buddy_arena_free(arena, live[slot]);
+		}
+	}
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print latency percentiles of one operation over all threads
+ */
+static void report(const char *op, worker_t *workers, int nthreads, int is_free)
+{
+	size_t n = 0;
+	for (int t = 0; t < nthreads; t++)
+		n += is_free ? workers[t].nr_free : workers[t].nr_alloc;
+
+	uint32_t *all = malloc(n * sizeof(uint32_t));
+	size_t k = 0;
+	for (int t = 0; t < nthreads; t++) {
+		int cnt = is_free ? workers[t].nr_free : workers[t].nr_alloc;
+		memcpy(all + k, is_free ? workers[t].free_ns : workers[t].alloc_ns, cnt * sizeof(uint32_t));
+		k += cnt;
+	}
+	qsort(all, n, sizeof(uint32_t), cmp_u32);
+
+	printf("%s,%zu,%u,%u,%u,%u\n", op, n, all[n / 2], all[n * 99 / 100],
+	       all[n * 999 / 1000], all[n - 1]);
+	free(all);
+}
+
+int main(int argc, char **argv)
+{
+	int nthreads = argc > 1 ? atoi(argv[1]) : 8;
+	void *mem = malloc(ARENA_SIZE);
+	worker_t *workers = calloc(nthreads, sizeof(worker_t));
+	pthread_t threads[nthreads];
+	int corrupted = 0;
+
+	arena = buddy_create(mem, ARENA_SIZE, 12);
+	assert(arena != NULL && workers != NULL);
+
+	for (int t = 0; t < nthreads; t++) {
+		workers[t].id = t;
+		pthread_create(&threads[t], NULL, worker, &workers[t]);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+		corrupted += workers[t].corrupted;
+	}
+
+	printf("op,count,p50_ns,p99_ns,p99.9_ns,max_ns\n");
+	report("alloc", workers, nthreads, 0);
+	report("free", workers, nthreads, 1);
+
+	long free_bytes = buddy_arena_check(arena);
+	printf("threads %d, corrupted blocks %d, free bytes %ld of %d\n",
+	       nthreads, corrupted, free_bytes, ARENA_SIZE);
+
+	int ok = corrupted == 0 && free_bytes == ARENA_SIZE;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+
+	buddy_destroy(arena);
+	free(workers);
+	free(mem);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Binary allocation trace, as written by `replay -o`
+ *
+ * A struct trace_header followed by nr_ops struct trace_op records, in host
+ * byte order. Variables are numbered from 0 to nr_vars - 1. Sizes are 64
+ * bits wide, like the size_t the allocator takes; traces of the 32 bit
+ * BDYTRC01 format are not read.
+ */
+
+#define TRACE_MAGIC "BDYTRC02"
+
+/* operations of a trace */
+enum trace_opcode {
+	TRACE_ALLOC,     ///< var = alloc(size)
+	TRACE_REALLOC,   ///< var = realloc(src, size)
+	TRACE_FREE,      ///< free(var)
+	TRACE_NR_OPS
+};
+
+struct trace_header {
+	char magic[8];       ///< TRACE_MAGIC, not terminated
+	uint64_t nr_ops;     ///< number of records that follow
+	uint32_t nr_vars;    ///< one more than the highest variable number
+	uint32_t reserved;   ///< zero
+};
+
+struct trace_op {
+	uint8_t op;          ///< enum trace_opcode
+	uint8_t reserved[7]; ///< zero
+	uint64_t size;       ///< bytes, for TRACE_ALLOC and TRACE_REALLOC
+	uint32_t var;        ///< variable assigned or freed
+	uint32_t src;        ///< variable resized, for TRACE_REALLOC
+};
+
+#endif // TRACE_H